@@ -1,38 +1,230 @@
 #define _USE_MATH_DEFINES
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
 #include <fstream>
 #include <vector>
 #include <cmath>
 #include <limits>
 #include <algorithm>
+#include <map>
+#include <tuple>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+// =============================================
+// Fast Math - opt-in via -DRAYTRACER_FAST_MATH
+// =============================================
+// Relative error bounds (measured against 1/std::sqrt and 1/x over 10^8
+// random inputs in [1e-30, 1e30], and by diffing the four default renders):
+//   rsqrt  SSE estimate + 1 Newton step          <= 1.6e-7
+//          SSE estimate + 2 Newton steps         <= 4.0e-14
+//          scalar bit-trick + 3 Newton steps     <= 3.2e-11
+//          scalar bit-trick + 4 Newton steps     <= 4.2e-16
+//   rcp    SSE estimate + 1 Newton step          <= 1.0e-7
+//          SSE estimate + 2 Newton steps         <= 1.0e-14
+//          scalar fallback (plain division)      exact
+//   fmadd  exact single rounding with hardware FMA (FP_FAST_FMA), else a * b + c
+// RAYTRACER_FAST_MATH_NEWTON_STEPS sets the SSE step count; the scalar fallback
+// always runs two more. With the default single step, the default scene's
+// images stay within one 8-bit code value of the exact build (at most 15 of
+// 1.44M channel values differ per image). Separately, the 19 rays exactly
+// tangent to a sphere (discriminant within rounding of zero) may flip between
+// hit and miss.
+#ifndef RAYTRACER_FAST_MATH_NEWTON_STEPS
+#define RAYTRACER_FAST_MATH_NEWTON_STEPS 1
+#endif
+
+namespace FastMath {
+    // Approximate 1 / sqrt(x) for x > 0
+    inline double rsqrt(double x) {
+#ifdef RAYTRACER_HAS_SSE2
+        // The float estimate only covers the float range
+        if (x < 1e-37 || x > 1e37) return 1.0 / std::sqrt(x);
+        double y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((float)x)));
+        for (int i = 0; i < RAYTRACER_FAST_MATH_NEWTON_STEPS; ++i) {
+            y = y * (1.5 - 0.5 * x * y * y);
+        }
+        return y;
+#else
+        long long bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        bits = 0x5FE6EB50C7B537A9LL - (bits >> 1);
+        double y;
+        std::memcpy(&y, &bits, sizeof(y));
+        for (int i = 0; i < RAYTRACER_FAST_MATH_NEWTON_STEPS + 2; ++i) {
+            y = y * (1.5 - 0.5 * x * y * y);
+        }
+        return y;
+#endif
+    }
+    
+    // Approximate 1 / x for x != 0
+    inline double rcp(double x) {
+#ifdef RAYTRACER_HAS_SSE2
+        double ax = std::fabs(x);
+        if (ax < 1e-37 || ax > 1e37) return 1.0 / x;
+        double y = _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss((float)x)));
+        for (int i = 0; i < RAYTRACER_FAST_MATH_NEWTON_STEPS; ++i) {
+            y = y * (2.0 - x * y);
+        }
+        return y;
+#else
+        return 1.0 / x;
+#endif
+    }
+    
+    // a * b + c, fused only where the hardware makes it cheap
+    inline double fmadd(double a, double b, double c) {
+#ifdef FP_FAST_FMA
+        return std::fma(a, b, c);
+#else
+        return a * b + c;
+#endif
+    }
+}
 
 // ====================================
 // Vector3 Class - Basic 3D vector math
 // ====================================
+#if defined(RAYTRACER_SIMD_VEC3) && defined(RAYTRACER_HAS_SSE2)
+// SSE2 variant, selected with -DRAYTRACER_SIMD_VEC3: the components live in
+// two 2-lane registers (x, y | z, w), with w as padding, and are read back
+// through the same accessors as the scalar class below. dot and length keep
+// the scalar class's summation order, with or without RAYTRACER_FAST_MATH, so
+// images are bit-identical; the price is 32 instead of 24 bytes per vector.
+class Vec3 {
+public:
+    Vec3() : xy(_mm_setzero_pd()), zw(_mm_setzero_pd()) {}
+    Vec3(double x, double y, double z) : xy(_mm_set_pd(y, x)), zw(_mm_set_pd(0.0, z)) {}
+    
+    double x() const { return _mm_cvtsd_f64(xy); }
+    double y() const {
+        double value;
+        _mm_storeh_pd(&value, xy);
+        return value;
+    }
+    double z() const { return _mm_cvtsd_f64(zw); }
+    
+    Vec3 operator+(const Vec3& v) const { return Vec3(_mm_add_pd(xy, v.xy), _mm_add_pd(zw, v.zw)); }
+    Vec3 operator-(const Vec3& v) const { return Vec3(_mm_sub_pd(xy, v.xy), _mm_sub_pd(zw, v.zw)); }
+    Vec3 operator*(double t) const {
+        __m128d tt = _mm_set1_pd(t);
+        return Vec3(_mm_mul_pd(xy, tt), _mm_mul_pd(zw, tt));
+    }
+    Vec3 operator/(double t) const {
+        __m128d tt = _mm_set1_pd(t);
+        return Vec3(_mm_div_pd(xy, tt), _mm_div_pd(zw, tt));
+    }
+    
+    // Component-wise multiplication (for colors)
+    Vec3 operator*(const Vec3& v) const { return Vec3(_mm_mul_pd(xy, v.xy), _mm_mul_pd(zw, v.zw)); }
+    
+#ifdef RAYTRACER_FAST_MATH
+    double dot(const Vec3& v) const { return FastMath::fmadd(x(), v.x(), FastMath::fmadd(y(), v.y(), z() * v.z())); }
+#else
+    double dot(const Vec3& v) const { return exactDot(v); }
+#endif
+    
+    Vec3 cross(const Vec3& v) const {
+        return Vec3(y() * v.z() - z() * v.y(), z() * v.x() - x() * v.z(), x() * v.y() - y() * v.x());
+    }
+    
+    double length() const { return std::sqrt(exactDot(*this)); }
+    
+    Vec3 normalize() const {
+#ifdef RAYTRACER_FAST_MATH
+        double len2 = dot(*this);
+        return len2 > 0 ? (*this) * FastMath::rsqrt(len2) : Vec3(0, 0, 0);
+#else
+        double len = length();
+        return len > 0 ? (*this) / len : Vec3(0, 0, 0);
+#endif
+    }
+    
+private:
+    __m128d xy, zw;
+    
+    Vec3(__m128d xy, __m128d zw) : xy(xy), zw(zw) {}
+    
+    // (x * v.x + y * v.y) + z * v.z, in the scalar class's order
+    double exactDot(const Vec3& v) const {
+        __m128d p = _mm_mul_pd(xy, v.xy);
+        __m128d q = _mm_mul_pd(zw, v.zw);
+        __m128d sum = _mm_add_sd(_mm_add_sd(p, _mm_unpackhi_pd(p, p)), q);
+        return _mm_cvtsd_f64(sum);
+    }
+};
+#else
 class Vec3 {
 public:
-    double x, y, z;
+    Vec3() : vx(0), vy(0), vz(0) {}
+    Vec3(double x, double y, double z) : vx(x), vy(y), vz(z) {}
     
-    Vec3() : x(0), y(0), z(0) {}
-    Vec3(double x, double y, double z) : x(x), y(y), z(z) {}
+    double x() const { return vx; }
+    double y() const { return vy; }
+    double z() const { return vz; }
     
-    Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
-    Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
-    Vec3 operator*(double t) const { return Vec3(x * t, y * t, z * t); }
-    Vec3 operator/(double t) const { return Vec3(x / t, y / t, z / t); }
+    Vec3 operator+(const Vec3& v) const { return Vec3(vx + v.vx, vy + v.vy, vz + v.vz); }
+    Vec3 operator-(const Vec3& v) const { return Vec3(vx - v.vx, vy - v.vy, vz - v.vz); }
+    Vec3 operator*(double t) const { return Vec3(vx * t, vy * t, vz * t); }
+    Vec3 operator/(double t) const { return Vec3(vx / t, vy / t, vz / t); }
     
     // Component-wise multiplication (for colors)
-    Vec3 operator*(const Vec3& v) const { return Vec3(x * v.x, y * v.y, z * v.z); }
+    Vec3 operator*(const Vec3& v) const { return Vec3(vx * v.vx, vy * v.vy, vz * v.vz); }
+    
+#ifdef RAYTRACER_FAST_MATH
+    double dot(const Vec3& v) const { return FastMath::fmadd(vx, v.vx, FastMath::fmadd(vy, v.vy, vz * v.vz)); }
+#else
+    double dot(const Vec3& v) const { return vx * v.vx + vy * v.vy + vz * v.vz; }
+#endif
     
-    double dot(const Vec3& v) const { return x * v.x + y * v.y + z * v.z; }
+    Vec3 cross(const Vec3& v) const {
+        return Vec3(vy * v.vz - vz * v.vy, vz * v.vx - vx * v.vz, vx * v.vy - vy * v.vx);
+    }
     
-    double length() const { return std::sqrt(x * x + y * y + z * z); }
+    double length() const { return std::sqrt(vx * vx + vy * vy + vz * vz); }
     
     Vec3 normalize() const {
+#ifdef RAYTRACER_FAST_MATH
+        double len2 = dot(*this);
+        return len2 > 0 ? (*this) * FastMath::rsqrt(len2) : Vec3(0, 0, 0);
+#else
         double len = length();
         return len > 0 ? (*this) / len : Vec3(0, 0, 0);
+#endif
     }
+    
+private:
+    double vx, vy, vz;
 };
+#endif
 
 // =========
 // Ray Class
@@ -48,15 +240,511 @@ public:
     Vec3 at(double t) const { return origin + direction * t; }
 };
 
+// ==========
+// AABB Class
+// ==========
+// Axis-aligned bounding box; default-constructed boxes are empty
+class AABB {
+public:
+    Vec3 pMin, pMax;
+    
+    AABB()
+        : pMin(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+               std::numeric_limits<double>::infinity()),
+          pMax(-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+               -std::numeric_limits<double>::infinity()) {}
+    AABB(const Vec3& pMin, const Vec3& pMax) : pMin(pMin), pMax(pMax) {}
+    
+    void expand(const Vec3& p) {
+        pMin = Vec3(std::min(pMin.x(), p.x()), std::min(pMin.y(), p.y()), std::min(pMin.z(), p.z()));
+        pMax = Vec3(std::max(pMax.x(), p.x()), std::max(pMax.y(), p.y()), std::max(pMax.z(), p.z()));
+    }
+    void expand(const AABB& box) {
+        expand(box.pMin);
+        expand(box.pMax);
+    }
+    
+    bool empty() const { return pMin.x() > pMax.x() || pMin.y() > pMax.y() || pMin.z() > pMax.z(); }
+    bool overlaps(const AABB& box) const {
+        return pMin.x() <= box.pMax.x() && pMax.x() >= box.pMin.x() &&
+               pMin.y() <= box.pMax.y() && pMax.y() >= box.pMin.y() &&
+               pMin.z() <= box.pMax.z() && pMax.z() >= box.pMin.z();
+    }
+    Vec3 center() const { return (pMin + pMax) * 0.5; }
+    Vec3 extent() const { return pMax - pMin; }
+    
+    // Slab test against [tMin, tMax]; invDir holds 1 / ray.direction per axis
+    bool intersect(const Ray& ray, const Vec3& invDir, double tMin, double tMax) const {
+        clipSlab(pMin.x(), pMax.x(), ray.origin.x(), invDir.x(), tMin, tMax);
+        clipSlab(pMin.y(), pMax.y(), ray.origin.y(), invDir.y(), tMin, tMax);
+        clipSlab(pMin.z(), pMax.z(), ray.origin.z(), invDir.z(), tMin, tMax);
+        return tMin <= tMax;
+    }
+    
+    double surfaceArea() const {
+        if (empty()) return 0;
+        Vec3 e = extent();
+        return 2.0 * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+    }
+    
+    static Vec3 inverseDirection(const Ray& ray) {
+        return Vec3(1.0 / ray.direction.x(), 1.0 / ray.direction.y(), 1.0 / ray.direction.z());
+    }
+    
+    // Box moved by offset, padded outward by a few ulps of the largest coordinate
+    // involved so it still contains whatever the original contained after the move
+    AABB translated(const Vec3& offset) const {
+        if (empty()) return *this;
+        double magnitude = std::max(std::max(maxAbs(pMin), maxAbs(pMax)), maxAbs(offset));
+        double pad = 4.0 * std::numeric_limits<double>::epsilon() * magnitude;
+        Vec3 padding(pad, pad, pad);
+        return AABB(pMin + offset - padding, pMax + offset + padding);
+    }
+    
+    // Clip [tMin, tMax] to one axis' slab
+    static void clipSlab(double lo, double hi, double origin, double invDir, double& tMin, double& tMax) {
+        double t0 = (lo - origin) * invDir;
+        double t1 = (hi - origin) * invDir;
+        if (t0 > t1) std::swap(t0, t1);
+        // Written so a NaN (0 * inf on a slab boundary) leaves the interval unchanged
+        if (t0 > tMin) tMin = t0;
+        if (t1 < tMax) tMax = t1;
+    }
+    
+private:
+    static double maxAbs(const Vec3& v) { return std::max(std::fabs(v.x()), std::max(std::fabs(v.y()), std::fabs(v.z()))); }
+};
+
 // ==============
 // Material Class
 // ==============
 class Material {
 public:
     Vec3 color;
+    int program; // Index into Scene::materialPrograms computing the color, or -1
+    
+    Material() : color(1, 1, 1), program(-1) {}
+    Material(const Vec3& color) : color(color), program(-1) {}
+    Material(const Vec3& color, int program) : color(color), program(program) {}
+};
+
+// ======================
+// Material Program Class
+// ======================
+// Procedural surface colors written in a small expression language and
+// compiled to register bytecode, e.g.
+//
+//     c = checker(x * 4, y * 4, z * 4);
+//     n = noise(x * 8, y * 8, z * 8);
+//     r = mix(0.9, 0.2, c) * (0.8 + 0.2 * n);
+//     g = mix(0.8, 0.2, c);
+//     b = 0.3 * n;
+//
+// Inputs are the hit point x, y, z, the normal nx, ny, nz and the material's own
+// color cr, cg, cb, so one program can serve differently tinted objects.
+// Statements assign names; r, g, b are the result (g and b default to r).
+// Functions: sin cos abs floor fract sqrt, min max pow step, mix clamp
+// smoothstep, noise checker. '#' starts a comment.
+//
+// evaluate() runs over many shading points at once. Registers hold BATCH floats
+// each and every instruction is one loop over the batch, so the dispatch cost is
+// paid once per BATCH points and the compiler vectorizes the loop bodies.
+class MaterialProgram {
+public:
+    static const int BATCH = 64;
+    
+    // Shading points in structure-of-arrays form; evaluate() fills r, g, b
+    struct ShadingPoints {
+        std::vector<float> x, y, z, nx, ny, nz, cr, cg, cb;
+        std::vector<float> r, g, b;
+        
+        size_t size() const { return x.size(); }
+        void clear() {
+            x.clear(); y.clear(); z.clear();
+            nx.clear(); ny.clear(); nz.clear();
+            cr.clear(); cg.clear(); cb.clear();
+        }
+        void add(const Vec3& point, const Vec3& normal, const Vec3& color) {
+            x.push_back((float)point.x()); y.push_back((float)point.y()); z.push_back((float)point.z());
+            nx.push_back((float)normal.x()); ny.push_back((float)normal.y()); nz.push_back((float)normal.z());
+            cr.push_back((float)color.x()); cg.push_back((float)color.y()); cb.push_back((float)color.z());
+        }
+        Vec3 color(size_t i) const { return Vec3(r[i], g[i], b[i]); }
+    };
+    
+    MaterialProgram() : registerCount(INPUT_COUNT) { output[0] = output[1] = output[2] = -1; }
+    
+    // Replaces the program; on failure returns false and describes the first error
+    bool compile(const std::string& source, std::string& error) {
+        code.clear();
+        constants.clear();
+        names.clear();
+        pending.clear();
+        registerCount = INPUT_COUNT;
+        output[0] = output[1] = output[2] = -1;
+        const char* inputs[INPUT_COUNT] = { "x", "y", "z", "nx", "ny", "nz", "cr", "cg", "cb" };
+        for (int i = 0; i < INPUT_COUNT; ++i) names[inputs[i]] = i;
+        
+        text = source;
+        pos = 0;
+        line = 1;
+        failed = false;
+        message.clear();
+        while (!failed && skipSpace()) statement();
+        if (!failed && !names.count("r")) fail("no value assigned to r");
+        if (failed) {
+            error = "line " + std::to_string(line) + ": " + message;
+            return false;
+        }
+        
+        // Final layout: inputs, constants, temporaries
+        for (const Pending& p : pending) {
+            Instruction in = { (unsigned char)p.op, finalRegister(p.dst), finalRegister(p.a),
+                               finalRegister(p.b), finalRegister(p.c) };
+            code.push_back(in);
+        }
+        output[0] = finalRegister(names["r"]);
+        output[1] = names.count("g") ? finalRegister(names["g"]) : output[0];
+        output[2] = names.count("b") ? finalRegister(names["b"]) : output[0];
+        registerCount += (int)constants.size();
+        pending.clear();
+        return true;
+    }
+    
+    bool valid() const { return output[0] >= 0; }
+    size_t instructionCount() const { return code.size(); }
+    
+    void evaluate(ShadingPoints& points) const {
+        size_t total = points.size();
+        points.r.resize(total);
+        points.g.resize(total);
+        points.b.resize(total);
+        
+        std::vector<float> registers((size_t)registerCount * BATCH, 0.0f);
+        for (size_t i = 0; i < constants.size(); ++i) {
+            std::fill(&registers[(INPUT_COUNT + i) * BATCH], &registers[(INPUT_COUNT + i + 1) * BATCH], constants[i]);
+        }
+        const std::vector<float>* inputs[INPUT_COUNT] = { &points.x, &points.y, &points.z, &points.nx, &points.ny,
+                                                          &points.nz, &points.cr, &points.cg, &points.cb };
+        std::vector<float>* outputs[3] = { &points.r, &points.g, &points.b };
+        
+        for (size_t start = 0; start < total; start += BATCH) {
+            size_t count = std::min((size_t)BATCH, total - start);
+            for (int i = 0; i < INPUT_COUNT; ++i) {
+                std::copy(inputs[i]->begin() + start, inputs[i]->begin() + start + count, &registers[i * BATCH]);
+            }
+            // Lanes past count compute on stale values; every loop runs the full batch
+            for (const Instruction& in : code) execute(in, &registers[0]);
+            for (int c = 0; c < 3; ++c) {
+                const float* result = &registers[output[c] * BATCH];
+                std::copy(result, result + count, outputs[c]->begin() + start);
+            }
+        }
+    }
+    
+    // One point; prefer evaluate() for many
+    Vec3 evaluate(const Vec3& point, const Vec3& normal, const Vec3& color) const {
+        ShadingPoints points;
+        points.add(point, normal, color);
+        evaluate(points);
+        return points.color(0);
+    }
+    
+    // Value noise in [0, 1), smooth across integer lattice cells
+    static float noise(float x, float y, float z) {
+        x = latticeClamp(x);
+        y = latticeClamp(y);
+        z = latticeClamp(z);
+        float fx = fastFloor(x), fy = fastFloor(y), fz = fastFloor(z);
+        int ix = (int)fx, iy = (int)fy, iz = (int)fz;
+        float u = smooth(x - fx), v = smooth(y - fy), w = smooth(z - fz);
+        float x00 = lerp(lattice(ix, iy, iz), lattice(ix + 1, iy, iz), u);
+        float x10 = lerp(lattice(ix, iy + 1, iz), lattice(ix + 1, iy + 1, iz), u);
+        float x01 = lerp(lattice(ix, iy, iz + 1), lattice(ix + 1, iy, iz + 1), u);
+        float x11 = lerp(lattice(ix, iy + 1, iz + 1), lattice(ix + 1, iy + 1, iz + 1), u);
+        return lerp(lerp(x00, x10, v), lerp(x01, x11, v), w);
+    }
+    
+    // 1 on odd unit cells, 0 on even ones
+    static float checker(float x, float y, float z) {
+        float sum = fastFloor(x) + fastFloor(y) + fastFloor(z);
+        return sum - 2.0f * fastFloor(sum * 0.5f);
+    }
+    
+private:
+    enum OpCode {
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG,
+        OP_SIN, OP_COS, OP_ABS, OP_FLOOR, OP_FRACT, OP_SQRT,
+        OP_MIN, OP_MAX, OP_POW, OP_STEP,
+        OP_MIX, OP_CLAMP, OP_SMOOTHSTEP, OP_NOISE, OP_CHECKER
+    };
+    
+    struct Instruction {
+        unsigned char op;
+        unsigned short dst, a, b, c; // Register numbers
+    };
+    
+    // Operands while compiling: registers >= 0, constant k as -1 - k
+    struct Pending {
+        OpCode op;
+        int dst, a, b, c;
+    };
+    
+    struct Function {
+        const char* name;
+        OpCode op;
+        int arity;
+    };
+    
+    static const int INPUT_COUNT = 9; // Registers 0-8; constants follow, then temporaries
+    
+    std::vector<Instruction> code;
+    std::vector<float> constants;
+    std::map<std::string, int> names; // Inputs and assigned names -> register
+    int registerCount;
+    int output[3];
+    
+    // Compiler state
+    std::vector<Pending> pending;
+    std::string text;
+    size_t pos;
+    int line;
+    bool failed;
+    std::string message;
+    
+    static float smooth(float t) { return t * t * (3.0f - 2.0f * t); }
+    
+    // Truncation-based floor; unlike std::floor it stays inline and vectorizes
+    // without SSE4.1. Only the clamped value c is converted to int, so huge
+    // inputs, infinities and NaN never reach the conversion. Floats of magnitude
+    // 2^23 or more are already integers, and v - c adds back what the clamp
+    // removed (0 in range), which returns them, infinities and NaN unchanged.
+    static float fastFloor(float v) {
+        float c = std::min(8388608.0f, std::max(-8388608.0f, v)); // NaN -> -2^23
+        float t = (float)(int)c;
+        return t - (t > c ? 1.0f : 0.0f) + (v - c);
+    }
+    
+    // Noise inputs limited to +-2^30 (NaN to -2^30), so lattice cells convert
+    // to int and their + 1 neighbours stay in range
+    static float latticeClamp(float v) { return std::min(1073741824.0f, std::max(-1073741824.0f, v)); }
+    static float lerp(float a, float b, float t) { return a + (b - a) * t; }
+    
+    static float lattice(int x, int y, int z) {
+        unsigned int h = (unsigned int)x * 374761393u + (unsigned int)y * 668265263u + (unsigned int)z * 2246822519u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        return (float)((h ^ (h >> 16)) & 0xFFFFFF) * (1.0f / 16777216.0f);
+    }
+    
+    static void execute(const Instruction& in, float* registers) {
+        float* d = registers + in.dst * BATCH;
+        const float* a = registers + in.a * BATCH;
+        const float* b = registers + in.b * BATCH;
+        const float* c = registers + in.c * BATCH;
+        switch (in.op) {
+        case OP_ADD:   for (int i = 0; i < BATCH; ++i) d[i] = a[i] + b[i]; break;
+        case OP_SUB:   for (int i = 0; i < BATCH; ++i) d[i] = a[i] - b[i]; break;
+        case OP_MUL:   for (int i = 0; i < BATCH; ++i) d[i] = a[i] * b[i]; break;
+        case OP_DIV:   for (int i = 0; i < BATCH; ++i) d[i] = a[i] / b[i]; break;
+        case OP_NEG:   for (int i = 0; i < BATCH; ++i) d[i] = -a[i]; break;
+        case OP_SIN:   for (int i = 0; i < BATCH; ++i) d[i] = std::sin(a[i]); break;
+        case OP_COS:   for (int i = 0; i < BATCH; ++i) d[i] = std::cos(a[i]); break;
+        case OP_ABS:   for (int i = 0; i < BATCH; ++i) d[i] = std::fabs(a[i]); break;
+        case OP_FLOOR: for (int i = 0; i < BATCH; ++i) d[i] = fastFloor(a[i]); break;
+        case OP_FRACT: for (int i = 0; i < BATCH; ++i) d[i] = a[i] - fastFloor(a[i]); break;
+        case OP_SQRT:  for (int i = 0; i < BATCH; ++i) d[i] = std::sqrt(std::max(a[i], 0.0f)); break;
+        case OP_MIN:   for (int i = 0; i < BATCH; ++i) d[i] = std::min(a[i], b[i]); break;
+        case OP_MAX:   for (int i = 0; i < BATCH; ++i) d[i] = std::max(a[i], b[i]); break;
+        case OP_POW:   for (int i = 0; i < BATCH; ++i) d[i] = std::pow(a[i], b[i]); break;
+        case OP_STEP:  for (int i = 0; i < BATCH; ++i) d[i] = b[i] < a[i] ? 0.0f : 1.0f; break;
+        case OP_MIX:   for (int i = 0; i < BATCH; ++i) d[i] = lerp(a[i], b[i], c[i]); break;
+        case OP_CLAMP: for (int i = 0; i < BATCH; ++i) d[i] = std::min(std::max(a[i], b[i]), c[i]); break;
+        case OP_SMOOTHSTEP:
+            for (int i = 0; i < BATCH; ++i) {
+                float t = std::min(std::max((c[i] - a[i]) / (b[i] - a[i]), 0.0f), 1.0f);
+                d[i] = smooth(t);
+            }
+            break;
+        case OP_NOISE:   for (int i = 0; i < BATCH; ++i) d[i] = noise(a[i], b[i], c[i]); break;
+        case OP_CHECKER: for (int i = 0; i < BATCH; ++i) d[i] = checker(a[i], b[i], c[i]); break;
+        }
+    }
+    
+    // Recursive descent over
+    //   statement := name '=' expr (';' | newline)
+    //   expr := term (('+' | '-') term)*      term := unary (('*' | '/') unary)*
+    //   unary := '-' unary | number | name | name '(' expr (',' expr)* ')' | '(' expr ')'
+    // Each operation writes a fresh register, so reassigning a name never
+    // disturbs values already computed from it.
+    
+    void fail(const std::string& what) {
+        if (!failed) message = what;
+        failed = true;
+    }
+    
+    // Skips blanks and '#' comments; stops at a newline unless crossNewlines.
+    // Returns false at the end of the text
+    bool skipSpace(bool crossNewlines = true) {
+        while (pos < text.size()) {
+            char ch = text[pos];
+            if (ch == '#') {
+                while (pos < text.size() && text[pos] != '\n') ++pos;
+            } else if (ch == '\n') {
+                if (!crossNewlines) break;
+                ++line;
+                ++pos;
+            } else if (ch == ' ' || ch == '\t' || ch == '\r') {
+                ++pos;
+            } else {
+                break;
+            }
+        }
+        return pos < text.size();
+    }
+    
+    bool accept(char ch) {
+        skipSpace(false);
+        if (pos < text.size() && text[pos] == ch) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+    
+    void expect(char ch) {
+        if (!accept(ch)) fail(std::string("expected '") + ch + "'");
+    }
+    
+    std::string identifier() {
+        skipSpace(false);
+        size_t start = pos;
+        while (pos < text.size() && (std::isalnum((unsigned char)text[pos]) || text[pos] == '_')) ++pos;
+        if (pos == start || std::isdigit((unsigned char)text[start])) {
+            pos = start;
+            return std::string();
+        }
+        return text.substr(start, pos - start);
+    }
+    
+    void statement() {
+        std::string name = identifier();
+        if (name.empty()) return fail("expected a name");
+        if (names.count(name) && names[name] >= 0 && names[name] < INPUT_COUNT) return fail("cannot assign to input '" + name + "'");
+        expect('=');
+        int value = expression();
+        if (failed) return;
+        names[name] = value;
+        skipSpace(false);
+        if (pos < text.size() && text[pos] != '\n' && !accept(';')) fail("expected ';' or a new line");
+    }
+    
+    int expression() {
+        int left = term();
+        while (!failed) {
+            if (accept('+')) left = emit(OP_ADD, left, term());
+            else if (accept('-')) left = emit(OP_SUB, left, term());
+            else break;
+        }
+        return left;
+    }
+    
+    int term() {
+        int left = unary();
+        while (!failed) {
+            if (accept('*')) left = emit(OP_MUL, left, unary());
+            else if (accept('/')) left = emit(OP_DIV, left, unary());
+            else break;
+        }
+        return left;
+    }
+    
+    int unary() {
+        if (failed) return 0;
+        if (accept('-')) return emit(OP_NEG, unary());
+        if (accept('(')) {
+            int value = expression();
+            expect(')');
+            return value;
+        }
+        skipSpace(false);
+        if (pos < text.size() && (std::isdigit((unsigned char)text[pos]) || text[pos] == '.')) {
+            const char* begin = text.c_str() + pos;
+            char* end;
+            float value = std::strtof(begin, &end);
+            if (end == begin) {
+                fail("bad number");
+                return 0;
+            }
+            pos += end - begin;
+            return constant(value);
+        }
+        
+        std::string name = identifier();
+        if (name.empty()) {
+            fail("expected a value");
+            return 0;
+        }
+        if (!accept('(')) {
+            std::map<std::string, int>::const_iterator it = names.find(name);
+            if (it == names.end()) fail("unknown name '" + name + "'");
+            return it == names.end() ? 0 : it->second;
+        }
+        
+        static const Function functions[] = {
+            { "sin", OP_SIN, 1 }, { "cos", OP_COS, 1 }, { "abs", OP_ABS, 1 }, { "floor", OP_FLOOR, 1 },
+            { "fract", OP_FRACT, 1 }, { "sqrt", OP_SQRT, 1 }, { "min", OP_MIN, 2 }, { "max", OP_MAX, 2 },
+            { "pow", OP_POW, 2 }, { "step", OP_STEP, 2 }, { "mix", OP_MIX, 3 }, { "clamp", OP_CLAMP, 3 },
+            { "smoothstep", OP_SMOOTHSTEP, 3 }, { "noise", OP_NOISE, 3 }, { "checker", OP_CHECKER, 3 }
+        };
+        const Function* function = 0;
+        for (const Function& f : functions) {
+            if (name == f.name) function = &f;
+        }
+        if (!function) {
+            fail("unknown function '" + name + "'");
+            return 0;
+        }
+        int args[3] = { 0, 0, 0 };
+        int count = 0;
+        if (!accept(')')) {
+            do {
+                int value = expression();
+                if (count < 3) args[count] = value;
+                ++count;
+            } while (!failed && accept(','));
+            expect(')');
+        }
+        if (count != function->arity) {
+            fail(name + " takes " + std::to_string(function->arity) + " arguments");
+            return 0;
+        }
+        return emit(function->op, args[0], args[1], args[2]);
+    }
+    
+    int constant(float value) {
+        for (size_t i = 0; i < constants.size(); ++i) {
+            if (constants[i] == value) return -1 - (int)i;
+        }
+        constants.push_back(value);
+        return -(int)constants.size();
+    }
+    
+    unsigned short finalRegister(int operand) const {
+        if (operand < 0) return (unsigned short)(INPUT_COUNT - 1 - operand);
+        if (operand < INPUT_COUNT) return (unsigned short)operand;
+        return (unsigned short)(operand + constants.size());
+    }
     
-    Material() : color(1, 1, 1) {}
-    Material(const Vec3& color) : color(color) {}
+    int emit(OpCode op, int a, int b = 0, int c = 0) {
+        if (failed) return 0;
+        if (registerCount + constants.size() >= 65535) {
+            fail("program too long");
+            return 0;
+        }
+        Pending in = { op, registerCount, a, b, c };
+        pending.push_back(in);
+        return registerCount++;
+    }
 };
 
 // ============
@@ -82,9 +770,18 @@ public:
         
         if (discriminant < 0) return false;
         
+#ifdef RAYTRACER_FAST_MATH
+        // Ray directions are normalized, so a is within rounding of 1 and one
+        // Newton step from 1 gives 1 / a
+        double sqrtd = std::sqrt(discriminant);
+        double inv2a = 0.5 * (2.0 - a);
+        double t0 = (-b - sqrtd) * inv2a;
+        double t1 = (-b + sqrtd) * inv2a;
+#else
         double sqrtd = std::sqrt(discriminant);
         double t0 = (-b - sqrtd) / (2.0 * a);
         double t1 = (-b + sqrtd) / (2.0 * a);
+#endif
         
         // Find the closest valid intersection
         if (t0 >= tMin && t0 <= tMax) {
@@ -99,271 +796,4943 @@ public:
         return false;
     }
     
+    AABB bounds() const {
+        Vec3 r(radius, radius, radius);
+        return AABB(center - r, center + r);
+    }
+    
     Vec3 getNormal(const Vec3& point) const {
+#ifdef RAYTRACER_FAST_MATH
+        // The hit point lies on the surface, so |point - center| is the radius
+        return (point - center) * FastMath::rcp(radius);
+#else
         return (point - center).normalize();
+#endif
     }
 };
 
-// ===========
-// Light Class
-// ===========
-class Light {
-public:
-    Vec3 position;
-    Vec3 color;
-    double intensity;
-    
-    Light(const Vec3& position, const Vec3& color = Vec3(1, 1, 1), double intensity = 1.0)
-        : position(position), color(color), intensity(intensity) {}
-};
-
-// ===========
-// Scene Class
-// ===========
-class Scene {
+// =============
+// Quadric Class
+// =============
+// Convex quadric solids: oriented ellipsoids, capped cylinders, capsules and
+// capped (optionally truncated) cones. Each shape is convex, so a ray crosses
+// it in at most one span [tNear, tFar]. intersect() returns the first end of
+// that span inside [tMin, tMax], which also covers rays starting inside.
+class Quadric {
 public:
-    std::vector<Sphere> spheres;
-    std::vector<Light> lights;
-    Vec3 ambientLight;
+    enum Type { ELLIPSOID, CYLINDER, CAPSULE, CONE };
     
-    Scene() : ambientLight(0.1, 0.1, 0.1) {}
+    Type type;
+    Vec3 center;     // Ellipsoid center
+    Vec3 axes[3];    // Ellipsoid semi-axes, mutually orthogonal
+    Vec3 p0, p1;     // Cylinder, capsule and cone axis end points
+    double radius0;  // Radius at p0; the cylinder and capsule radius
+    double radius1;  // Cone radius at p1 (0 for a pointed cone)
+    Material material;
     
-    void addSphere(const Sphere& sphere) { spheres.push_back(sphere); }
-    void addLight(const Light& light) { lights.push_back(light); }
+    static Quadric ellipsoid(const Vec3& center, const Vec3& radii, const Material& material) {
+        return ellipsoid(center, Vec3(radii.x(), 0, 0), Vec3(0, radii.y(), 0), Vec3(0, 0, radii.z()), material);
+    }
+    static Quadric ellipsoid(const Vec3& center, const Vec3& a, const Vec3& b, const Vec3& c, const Material& material) {
+        Quadric q(ELLIPSOID, material);
+        q.center = center;
+        q.axes[0] = a;
+        q.axes[1] = b;
+        q.axes[2] = c;
+        return q;
+    }
+    static Quadric cylinder(const Vec3& p0, const Vec3& p1, double radius, const Material& material) {
+        return segment(CYLINDER, p0, p1, radius, radius, material);
+    }
+    static Quadric capsule(const Vec3& p0, const Vec3& p1, double radius, const Material& material) {
+        return segment(CAPSULE, p0, p1, radius, radius, material);
+    }
+    static Quadric cone(const Vec3& p0, const Vec3& p1, double radius0, double radius1, const Material& material) {
+        return segment(CONE, p0, p1, radius0, radius1, material);
+    }
     
-    // Find closest intersection with any sphere
-    bool intersect(const Ray& ray, double& tClosest, int& sphereIndex, double tMin = 0.001) const {
-        tClosest = std::numeric_limits<double>::infinity();
-        sphereIndex = -1;
-        
-        for (size_t i = 0; i < spheres.size(); ++i) {
-            double t;
-            if (spheres[i].intersect(ray, t, tMin, tClosest)) {
-                tClosest = t;
-                sphereIndex = i;
-            }
+    // The solid's span along the ray, unclipped; false when the ray misses it
+    bool span(const Ray& ray, double& tNear, double& tFar) const {
+        switch (type) {
+        case ELLIPSOID: return ellipsoidSpan(ray, tNear, tFar);
+        case CYLINDER:  return coneSpan(ray, tNear, tFar);
+        case CAPSULE:   return capsuleSpan(ray, tNear, tFar);
+        case CONE:      return coneSpan(ray, tNear, tFar);
         }
-        
-        return sphereIndex != -1;
+        return false;
     }
     
-    // Check if point is in shadow
-    bool isInShadow(const Vec3& point, const Vec3& lightPos) const {
-        Vec3 toLight = lightPos - point;
-        double distToLight = toLight.length();
-        Ray shadowRay(point, toLight);
-        
-        double t;
-        int sphereIdx;
-        // Check if any object blocks the light
-        if (intersect(shadowRay, t, sphereIdx, 0.001)) {
-            // If intersection is closer than light, we're in shadow
-            return t < distToLight;
+    bool intersect(const Ray& ray, double& t, double tMin = 0.001, double tMax = std::numeric_limits<double>::infinity()) const {
+        double tNear, tFar;
+        if (!span(ray, tNear, tFar)) return false;
+        if (tNear >= tMin && tNear <= tMax) {
+            t = tNear;
+            return true;
+        }
+        if (tFar >= tMin && tFar <= tMax) {
+            t = tFar;
+            return true;
         }
-        
         return false;
     }
-};
-
-// ============
-// Camera Class
-// ============
-class Camera {
-public:
-    Vec3 position;
-    Vec3 lookAt;
-    Vec3 up;
-    double fov; // Field of view in degrees
     
-    Camera(const Vec3& position, const Vec3& lookAt, const Vec3& up, double fov)
-        : position(position), lookAt(lookAt), up(up), fov(fov) {}
+    AABB bounds() const {
+        if (type == ELLIPSOID) {
+            Vec3 e(std::sqrt(axes[0].x() * axes[0].x() + axes[1].x() * axes[1].x() + axes[2].x() * axes[2].x()),
+                   std::sqrt(axes[0].y() * axes[0].y() + axes[1].y() * axes[1].y() + axes[2].y() * axes[2].y()),
+                   std::sqrt(axes[0].z() * axes[0].z() + axes[1].z() * axes[1].z() + axes[2].z() * axes[2].z()));
+            return AABB(center - e, center + e);
+        }
+        if (type == CAPSULE) {
+            Vec3 r(radius0, radius0, radius0);
+            AABB box(p0 - r, p0 + r);
+            box.expand(AABB(p1 - r, p1 + r));
+            return box;
+        }
+        // Each end cap is a disc; its extent along an axis is radius * sqrt(1 - axis component^2)
+        Vec3 a = (p1 - p0).normalize();
+        Vec3 e(std::sqrt(std::max(0.0, 1.0 - a.x() * a.x())), std::sqrt(std::max(0.0, 1.0 - a.y() * a.y())),
+               std::sqrt(std::max(0.0, 1.0 - a.z() * a.z())));
+        AABB box(p0 - e * radius0, p0 + e * radius0);
+        box.expand(AABB(p1 - e * radius1, p1 + e * radius1));
+        return box;
+    }
     
-    Ray getRay(double u, double v, int width, int height) const {
-        // Calculate camera basis vectors
-        Vec3 forward = (lookAt - position).normalize();
-        Vec3 right = Vec3(forward.y * up.z - forward.z * up.y,
-                          forward.z * up.x - forward.x * up.z,
-                          forward.x * up.y - forward.y * up.x).normalize(); // cross product
-        Vec3 upVec = Vec3(right.y * forward.z - right.z * forward.y,
-                          right.z * forward.x - right.x * forward.z,
-                          right.x * forward.y - right.y * forward.x); // cross product
-        
-        double aspectRatio = (double)width / height;
-        double scale = std::tan(fov * 0.5 * M_PI / 180.0);
+    Vec3 getNormal(const Vec3& point) const {
+        if (type == ELLIPSOID) {
+            Vec3 p = point - center;
+            Vec3 gradient(0, 0, 0);
+            for (int i = 0; i < 3; ++i) {
+                double len2 = axes[i].dot(axes[i]);
+                gradient = gradient + axes[i] * (p.dot(axes[i]) / (len2 * len2));
+            }
+            return gradient.normalize();
+        }
         
-        // Map pixel coordinates to [-1, 1] range
-        double x = (2.0 * u / width - 1.0) * aspectRatio * scale;
-        double y = (1.0 - 2.0 * v / height) * scale;
+        Vec3 axis = p1 - p0;
+        double length = axis.length();
+        axis = axis / length;
+        double h = (point - p0).dot(axis);
+        if (type == CAPSULE) {
+            return (point - (p0 + axis * std::min(std::max(h, 0.0), length))).normalize();
+        }
         
-        Vec3 direction = (forward + right * x + upVec * y).normalize();
-        return Ray(position, direction);
+        // Cylinder or cone: pick the side or cap surface the point lies closest to
+        Vec3 radial = point - p0 - axis * h;
+        double radialLength = radial.length();
+        double slope = (radius1 - radius0) / length;
+        double sideDistance = std::fabs(radialLength - (radius0 + slope * h)) / std::sqrt(1.0 + slope * slope);
+        if (radialLength == 0 || std::min(std::fabs(h), std::fabs(h - length)) < sideDistance) {
+            return h < 0.5 * length ? axis * -1.0 : axis;
+        }
+        return (radial / radialLength - axis * slope).normalize();
     }
-};
-
-// ===========
-// Image Class
-// ===========
-class Image {
-public:
-    int width, height;
-    std::vector<Vec3> pixels;
     
-    Image(int width, int height) : width(width), height(height) {
-        pixels.resize(width * height);
+    void translate(const Vec3& offset) {
+        center = center + offset;
+        p0 = p0 + offset;
+        p1 = p1 + offset;
     }
     
-    void setPixel(int x, int y, const Vec3& color) {
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-            pixels[y * width + x] = color;
-        }
+private:
+    Quadric(Type type, const Material& material) : type(type), radius0(0), radius1(0), material(material) {}
+    
+    static Quadric segment(Type type, const Vec3& p0, const Vec3& p1, double radius0, double radius1,
+                           const Material& material) {
+        Quadric q(type, material);
+        q.center = (p0 + p1) * 0.5;
+        q.p0 = p0;
+        q.p1 = p1;
+        q.radius0 = radius0;
+        q.radius1 = radius1;
+        return q;
     }
     
-    Vec3 getPixel(int x, int y) const {
+    // Where a t^2 + b t + c <= 0, as one interval [t0, t1] or, for a < 0, the
+    // complement of (t0, t1). Returns false when the set is empty.
+    static bool quadraticSet(double a, double b, double c, double& t0, double& t1, bool& complement) {
+        const double inf = std::numeric_limits<double>::infinity();
+        complement = false;
+        if (std::fabs(a) < 1e-12 * (std::fabs(b) + std::fabs(c) + 1e-300)) {
+            // Linear: b t + c <= 0
+            if (b == 0) {
+                t0 = -inf;
+                t1 = inf;
+                return c <= 0;
+            }
+            t0 = b > 0 ? -inf : -c / b;
+            t1 = b > 0 ? -c / b : inf;
+            return true;
+        }
+        double discriminant = b * b - 4 * a * c;
+        if (discriminant < 0) {
+            // Entirely positive (a > 0) or entirely non-positive (a < 0)
+            t0 = -inf;
+            t1 = inf;
+            return a < 0;
+        }
+        double sqrtd = std::sqrt(discriminant);
+        double r0 = (-b - sqrtd) / (2.0 * a);
+        double r1 = (-b + sqrtd) / (2.0 * a);
+        t0 = std::min(r0, r1);
+        t1 = std::max(r0, r1);
+        complement = a < 0;
+        return true;
+    }
+    
+    static bool sphereSpan(const Ray& ray, const Vec3& center, double radius, double& tNear, double& tFar) {
+        Vec3 oc = ray.origin - center;
+        bool complement;
+        return quadraticSet(ray.direction.dot(ray.direction), 2.0 * oc.dot(ray.direction),
+                            oc.dot(oc) - radius * radius, tNear, tFar, complement);
+    }
+    
+    bool ellipsoidSpan(const Ray& ray, double& tNear, double& tFar) const {
+        // Unit sphere in the frame spanned by the semi-axes
+        Vec3 oc = ray.origin - center;
+        double o[3], d[3];
+        for (int i = 0; i < 3; ++i) {
+            double len2 = axes[i].dot(axes[i]);
+            o[i] = oc.dot(axes[i]) / len2;
+            d[i] = ray.direction.dot(axes[i]) / len2;
+        }
+        double a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+        double b = 2.0 * (o[0] * d[0] + o[1] * d[1] + o[2] * d[2]);
+        double c = o[0] * o[0] + o[1] * o[1] + o[2] * o[2] - 1.0;
+        bool complement;
+        return quadraticSet(a, b, c, tNear, tFar, complement);
+    }
+    
+    // Clip [tNear, tFar] to the slab between the planes through p0 and p1 normal to the axis
+    bool clipToSlab(const Ray& ray, const Vec3& axis, double length, double& tNear, double& tFar) const {
+        double h0 = (ray.origin - p0).dot(axis);
+        double dh = ray.direction.dot(axis);
+        if (dh == 0) return h0 >= 0 && h0 <= length && tNear <= tFar;
+        double s0 = -h0 / dh, s1 = (length - h0) / dh;
+        if (s0 > s1) std::swap(s0, s1);
+        tNear = std::max(tNear, s0);
+        tFar = std::min(tFar, s1);
+        return tNear <= tFar;
+    }
+    
+    // Cylinders are cones with equal radii: radial distance <= r0 + slope * h inside the slab
+    bool coneSpan(const Ray& ray, double& tNear, double& tFar) const {
+        Vec3 axis = p1 - p0;
+        double length = axis.length();
+        axis = axis / length;
+        double slope = (radius1 - radius0) / length;
+        
+        Vec3 oc = ray.origin - p0;
+        double h0 = oc.dot(axis), dh = ray.direction.dot(axis);
+        Vec3 oPerp = oc - axis * h0;
+        Vec3 dPerp = ray.direction - axis * dh;
+        double g0 = radius0 + slope * h0, g1 = slope * dh; // Allowed radius along the ray: g0 + g1 t
+        double t0, t1;
+        bool complement;
+        if (!quadraticSet(dPerp.dot(dPerp) - g1 * g1, 2.0 * (oPerp.dot(dPerp) - g0 * g1), oPerp.dot(oPerp) - g0 * g0,
+                          t0, t1, complement)) {
+            return false;
+        }
+        
+        const double inf = std::numeric_limits<double>::infinity();
+        if (!complement) {
+            tNear = t0;
+            tFar = t1;
+            return clipToSlab(ray, axis, length, tNear, tFar);
+        }
+        // Both nappes of the double cone: inside the slab the frustum is convex, so
+        // at most one of the two rays (-inf, t0] and [t1, inf) reaches into it
+        tNear = -inf;
+        tFar = t0;
+        if (clipToSlab(ray, axis, length, tNear, tFar)) return true;
+        tNear = t1;
+        tFar = inf;
+        return clipToSlab(ray, axis, length, tNear, tFar);
+    }
+    
+    // Union of the body and the two end spheres; the capsule is convex, so it is one span
+    bool capsuleSpan(const Ray& ray, double& tNear, double& tFar) const {
+        const double inf = std::numeric_limits<double>::infinity();
+        tNear = inf;
+        tFar = -inf;
+        double a, b;
+        if (coneSpan(ray, a, b)) {
+            tNear = std::min(tNear, a);
+            tFar = std::max(tFar, b);
+        }
+        if (sphereSpan(ray, p0, radius0, a, b)) {
+            tNear = std::min(tNear, a);
+            tFar = std::max(tFar, b);
+        }
+        if (sphereSpan(ray, p1, radius0, a, b)) {
+            tNear = std::min(tNear, a);
+            tFar = std::max(tFar, b);
+        }
+        return tNear <= tFar;
+    }
+};
+
+// ===============
+// CSG Shape Class
+// ===============
+// Constructive solid geometry over quadric leaves (spheres become ellipsoids
+// with equal radii): union, intersection and difference nodes evaluated with
+// ray-interval arithmetic. Each leaf yields its span along the ray; nodes
+// combine the sorted span lists, and the first span end inside [tMin, tMax]
+// is the hit. Span ends remember the leaf that produced them, so the hit
+// reports which leaf surface it is on.
+//
+// A leaf that sits in the subtracted operand of an odd number of difference
+// nodes faces inward on the result, so its normals are flipped. That depends
+// only on the tree, so use each leaf node once.
+class CSGShape {
+public:
+    enum Op { CSG_LEAF, CSG_UNION, CSG_INTERSECTION, CSG_DIFFERENCE };
+    
+    struct Node {
+        Op op;
+        int left, right; // Child nodes
+        int leaf;        // Index into `leaves` for CSG_LEAF
+    };
+    
+    static const int MAX_SPANS = 16; // Per node on the fast path; rays with more re-evaluate on the heap
+    
+    std::vector<Quadric> leaves;
+    std::vector<bool> flipped;       // Per leaf, see above; set by finish()
+    std::vector<Node> nodes;
+    int root;                        // The most recently created node unless set
+    
+    CSGShape() : root(-1) {}
+    
+    // Builders; each returns the new node's index and makes it the root
+    int leaf(const Quadric& quadric) {
+        leaves.push_back(quadric);
+        Node node = { CSG_LEAF, -1, -1, (int)leaves.size() - 1 };
+        return push(node);
+    }
+    int leaf(const Sphere& sphere) {
+        Vec3 r(sphere.radius, sphere.radius, sphere.radius);
+        return leaf(Quadric::ellipsoid(sphere.center, r, sphere.material));
+    }
+    int unite(int a, int b) { return combine(CSG_UNION, a, b); }
+    int intersection(int a, int b) { return combine(CSG_INTERSECTION, a, b); }
+    int difference(int a, int b) { return combine(CSG_DIFFERENCE, a, b); }
+    
+    // Compute the normal flips; Scene::addCSG calls this
+    void finish() {
+        flipped.assign(leaves.size(), false);
+        if (root >= 0) markFlips(root, false);
+    }
+    
+    // Closest hit in [tMin, tMax]; leafIndex names the leaf surface hit
+    bool intersect(const Ray& ray, double& t, int& leafIndex, double tMin, double tMax) const {
+        if (root < 0) return false;
+        SpanList list = evaluate<SpanList>(root, ray);
+        if (list.overflowed) return firstHit(evaluate<LongSpanList>(root, ray), t, leafIndex, tMin, tMax);
+        return firstHit(list, t, leafIndex, tMin, tMax);
+    }
+    
+    Vec3 getNormal(int leafIndex, const Vec3& point) const {
+        Vec3 normal = leaves[leafIndex].getNormal(point);
+        return flipped[leafIndex] ? normal * -1.0 : normal;
+    }
+    
+    AABB bounds() const { return root < 0 ? AABB() : nodeBounds(root); }
+    
+    void translate(const Vec3& offset) {
+        for (Quadric& quadric : leaves) quadric.translate(offset);
+    }
+    
+private:
+    struct Span {
+        double tNear, tFar;
+        int nearLeaf, farLeaf;
+    };
+    
+    // Disjoint spans sorted along the ray, in a fixed array. A full list sets
+    // overflowed instead of silently dropping spans, and the flag propagates
+    // to the root so intersect() can redo the ray with LongSpanList.
+    struct SpanList {
+        int count;
+        bool overflowed;
+        Span spans[MAX_SPANS];
+        
+        SpanList() : count(0), overflowed(false) {}
+        int size() const { return count; }
+        const Span& operator[](int i) const { return spans[i]; }
+        Span& back() { return spans[count - 1]; }
+        void add(const Span& span) {
+            if (count < MAX_SPANS) spans[count++] = span;
+            else overflowed = true;
+        }
+    };
+    
+    // Unbounded fallback for rays crossing more than MAX_SPANS spans
+    struct LongSpanList {
+        bool overflowed;
+        std::vector<Span> spans;
+        
+        LongSpanList() : overflowed(false) {}
+        int size() const { return (int)spans.size(); }
+        const Span& operator[](int i) const { return spans[i]; }
+        Span& back() { return spans.back(); }
+        void add(const Span& span) { spans.push_back(span); }
+    };
+    
+    template <class List>
+    static bool firstHit(const List& list, double& t, int& leafIndex, double tMin, double tMax) {
+        for (int i = 0; i < list.size(); ++i) {
+            const Span& span = list[i];
+            if (span.tNear > tMax) break;
+            if (span.tNear >= tMin) {
+                t = span.tNear;
+                leafIndex = span.nearLeaf;
+                return true;
+            }
+            if (span.tFar >= tMin && span.tFar <= tMax) {
+                t = span.tFar;
+                leafIndex = span.farLeaf;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    int push(const Node& node) {
+        nodes.push_back(node);
+        root = (int)nodes.size() - 1;
+        return root;
+    }
+    
+    int combine(Op op, int a, int b) {
+        Node node = { op, a, b, -1 };
+        return push(node);
+    }
+    
+    void markFlips(int index, bool flip) {
+        const Node& node = nodes[index];
+        if (node.op == CSG_LEAF) {
+            flipped[node.leaf] = flip;
+            return;
+        }
+        markFlips(node.left, flip);
+        markFlips(node.right, node.op == CSG_DIFFERENCE ? !flip : flip);
+    }
+    
+    AABB nodeBounds(int index) const {
+        const Node& node = nodes[index];
+        switch (node.op) {
+        case CSG_LEAF:
+            return leaves[node.leaf].bounds();
+        case CSG_UNION: {
+            AABB box = nodeBounds(node.left);
+            box.expand(nodeBounds(node.right));
+            return box;
+        }
+        case CSG_INTERSECTION: {
+            AABB a = nodeBounds(node.left), b = nodeBounds(node.right);
+            return AABB(Vec3(std::max(a.pMin.x(), b.pMin.x()), std::max(a.pMin.y(), b.pMin.y()), std::max(a.pMin.z(), b.pMin.z())),
+                        Vec3(std::min(a.pMax.x(), b.pMax.x()), std::min(a.pMax.y(), b.pMax.y()), std::min(a.pMax.z(), b.pMax.z())));
+        }
+        case CSG_DIFFERENCE:
+            return nodeBounds(node.left);
+        }
+        return AABB();
+    }
+    
+    template <class List>
+    List evaluate(int index, const Ray& ray) const {
+        const Node& node = nodes[index];
+        List result;
+        if (node.op == CSG_LEAF) {
+            Span span;
+            if (leaves[node.leaf].span(ray, span.tNear, span.tFar)) {
+                span.nearLeaf = span.farLeaf = node.leaf;
+                result.add(span);
+            }
+            return result;
+        }
+        
+        List a = evaluate<List>(node.left, ray);
+        if (a.size() == 0 && node.op != CSG_UNION) return result;
+        List b = evaluate<List>(node.right, ray);
+        result.overflowed = a.overflowed || b.overflowed;
+        switch (node.op) {
+        case CSG_UNION:
+            uniteSpans(a, b, result);
+            break;
+        case CSG_INTERSECTION:
+            intersectSpans(a, b, result);
+            break;
+        case CSG_DIFFERENCE:
+            subtractSpans(a, b, result);
+            break;
+        case CSG_LEAF:
+            break;
+        }
+        return result;
+    }
+    
+    template <class List>
+    static void uniteSpans(const List& a, const List& b, List& result) {
+        int i = 0, j = 0;
+        while (i < a.size() || j < b.size()) {
+            const Span& next = (j >= b.size() || (i < a.size() && a[i].tNear <= b[j].tNear)) ? a[i++] : b[j++];
+            if (result.size() > 0 && next.tNear <= result.back().tFar) {
+                Span& last = result.back();
+                if (next.tFar > last.tFar) {
+                    last.tFar = next.tFar;
+                    last.farLeaf = next.farLeaf;
+                }
+            } else {
+                result.add(next);
+            }
+        }
+    }
+    
+    template <class List>
+    static void intersectSpans(const List& a, const List& b, List& result) {
+        int i = 0, j = 0;
+        while (i < a.size() && j < b.size()) {
+            const Span& x = a[i];
+            const Span& y = b[j];
+            Span span;
+            span.tNear = x.tNear >= y.tNear ? x.tNear : y.tNear;
+            span.nearLeaf = x.tNear >= y.tNear ? x.nearLeaf : y.nearLeaf;
+            span.tFar = x.tFar <= y.tFar ? x.tFar : y.tFar;
+            span.farLeaf = x.tFar <= y.tFar ? x.farLeaf : y.farLeaf;
+            if (span.tNear <= span.tFar) result.add(span);
+            if (x.tFar <= y.tFar) ++i; else ++j;
+        }
+    }
+    
+    // a minus b: the subtracted spans' far ends become near ends and vice versa
+    template <class List>
+    static void subtractSpans(const List& a, const List& b, List& result) {
+        int j = 0;
+        for (int i = 0; i < a.size(); ++i) {
+            Span current = a[i];
+            while (j < b.size() && b[j].tFar < current.tNear) ++j;
+            bool alive = true;
+            for (int k = j; k < b.size() && b[k].tNear <= current.tFar; ++k) {
+                const Span& cut = b[k];
+                if (cut.tNear > current.tNear) {
+                    Span piece = { current.tNear, cut.tNear, current.nearLeaf, cut.nearLeaf };
+                    result.add(piece);
+                }
+                if (cut.tFar >= current.tFar) {
+                    alive = false;
+                    break;
+                }
+                current.tNear = cut.tFar;
+                current.nearLeaf = cut.farLeaf;
+            }
+            if (alive) result.add(current);
+        }
+    }
+};
+
+// ========================
+// Compact Sphere Set Class
+// ========================
+// Quantized sphere storage for very large sphere counts: 10 bytes per sphere
+// plus a 60-byte header per cluster of up to 65536 spheres. Centers are stored
+// as 16-bit offsets inside the cluster's box, radii as 16-bit multiples of a
+// per-cluster step and materials as 16-bit indices into a shared palette.
+// Spheres are decoded on the fly during intersection.
+//
+// Quantization is conservative: each stored radius is rounded up by the center's
+// quantization error, so the decoded sphere always contains the original one and
+// touching spheres never open cracks between them.
+//
+// Clusters are runs of consecutive input spheres, so feed spheres in a spatially
+// coherent order (e.g. after Scene::reorderSpheres()) to keep the boxes tight.
+// In a Scene each cluster is one PRIM_CLUSTER primitive of the scene BVH, so a
+// ray only visits clusters near it; smaller clusters mean fewer sphere tests per
+// visited cluster at 60 bytes of header each.
+class CompactSphereSet {
+public:
+    struct PackedSphere {
+        unsigned short x, y, z;  // center, in steps of the cluster's scale from its origin
+        unsigned short radius;   // in steps of the cluster's radiusScale
+        unsigned short material; // palette index
+    };
+    
+    struct Cluster {
+        float origin[3];
+        float scale[3];
+        float radiusScale;
+        float boundsMin[3], boundsMax[3]; // covers every decoded sphere
+        unsigned int first, count;
+    };
+    
+    std::vector<Cluster> clusters;
+    std::vector<PackedSphere> packed;
+    std::vector<Material> palette;
+    
+    bool empty() const { return packed.empty(); }
+    size_t size() const { return packed.size(); }
+    size_t memoryBytes() const {
+        return clusters.size() * sizeof(Cluster) + packed.size() * sizeof(PackedSphere) +
+               palette.size() * sizeof(Material);
+    }
+    
+    static const size_t MAX_CLUSTER_SIZE = 65536;
+    
+    // Quantize spheres into clusters of at most clusterSize spheres each
+    // (and at most MAX_CLUSTER_SIZE)
+    void build(const std::vector<Sphere>& spheres, size_t clusterSize = 256) {
+        clusterSize = std::max((size_t)1, clusterSize);
+        for (size_t first = 0; first < spheres.size(); first += clusterSize) {
+            addCluster(&spheres[first], std::min(clusterSize, spheres.size() - first));
+        }
+    }
+    
+    // Append spheres as one cluster, or as several of MAX_CLUSTER_SIZE when there
+    // are more; lets callers stream spheres in without holding them all
+    void addCluster(const Sphere* spheres, size_t count) {
+        for (; count > MAX_CLUSTER_SIZE; spheres += MAX_CLUSTER_SIZE, count -= MAX_CLUSTER_SIZE) {
+            addCluster(spheres, MAX_CLUSTER_SIZE);
+        }
+        if (count == 0) return;
+        
+        Cluster cluster;
+        cluster.first = (unsigned int)packed.size();
+        cluster.count = (unsigned int)count;
+        
+        AABB centers;
+        for (size_t i = 0; i < count; ++i) centers.expand(spheres[i].center);
+        double lo[3] = { centers.pMin.x(), centers.pMin.y(), centers.pMin.z() };
+        double hi[3] = { centers.pMax.x(), centers.pMax.y(), centers.pMax.z() };
+        for (int k = 0; k < 3; ++k) {
+            cluster.origin[k] = roundDown(lo[k]);
+            cluster.scale[k] = roundUp((hi[k] - cluster.origin[k]) / 65535.0);
+        }
+        
+        // Quantize centers first; the radius step must cover the largest padded radius
+        std::vector<double> paddedRadius(count);
+        double maxRadius = 0;
+        size_t base = packed.size();
+        packed.resize(base + count);
+        for (size_t i = 0; i < count; ++i) {
+            const Sphere& sphere = spheres[i];
+            PackedSphere& p = packed[base + i];
+            double c[3] = { sphere.center.x(), sphere.center.y(), sphere.center.z() };
+            unsigned short* q[3] = { &p.x, &p.y, &p.z };
+            for (int k = 0; k < 3; ++k) {
+                double steps = cluster.scale[k] > 0 ? (c[k] - cluster.origin[k]) / cluster.scale[k] : 0.0;
+                *q[k] = (unsigned short)std::min(std::max(std::floor(steps + 0.5), 0.0), 65535.0);
+            }
+            Vec3 error = decodeCenter(cluster, p) - sphere.center;
+            paddedRadius[i] = sphere.radius + error.length();
+            maxRadius = std::max(maxRadius, paddedRadius[i]);
+            p.material = paletteIndex(sphere.material);
+        }
+        
+        cluster.radiusScale = roundUp(maxRadius / 65535.0);
+        AABB bounds;
+        for (size_t i = 0; i < count; ++i) {
+            PackedSphere& p = packed[base + i];
+            double steps = cluster.radiusScale > 0 ? std::ceil(paddedRadius[i] / cluster.radiusScale) : 0.0;
+            p.radius = (unsigned short)std::min(steps, 65535.0);
+            // Rounding in the division can still land one step short
+            if (p.radius < 65535 && p.radius * (double)cluster.radiusScale < paddedRadius[i]) ++p.radius;
+            bounds.expand(decode(cluster, p).bounds());
+        }
+        cluster.boundsMin[0] = roundDown(bounds.pMin.x());
+        cluster.boundsMin[1] = roundDown(bounds.pMin.y());
+        cluster.boundsMin[2] = roundDown(bounds.pMin.z());
+        cluster.boundsMax[0] = roundUp(bounds.pMax.x());
+        cluster.boundsMax[1] = roundUp(bounds.pMax.y());
+        cluster.boundsMax[2] = roundUp(bounds.pMax.z());
+        
+        clusters.push_back(cluster);
+    }
+    
+    // Closest hit in [tMin, tMax] over every cluster; index counts packed
+    // spheres. Scene puts the clusters in its BVH and calls intersectCluster.
+    bool intersect(const Ray& ray, double& tClosest, int& index, double tMin, double tMax) const {
+        Vec3 invDir = AABB::inverseDirection(ray);
+        bool hit = false;
+        for (size_t c = 0; c < clusters.size(); ++c) {
+            if (intersectCluster(c, ray, invDir, tClosest, index, tMin, tMax)) {
+                tMax = tClosest;
+                hit = true;
+            }
+        }
+        return hit;
+    }
+    
+    // Closest hit in [tMin, tMax] among one cluster's spheres
+    bool intersectCluster(size_t c, const Ray& ray, const Vec3& invDir, double& tClosest, int& index,
+                          double tMin, double tMax) const {
+        const Cluster& cluster = clusters[c];
+        if (!clusterBounds(cluster).intersect(ray, invDir, tMin, tMax)) return false;
+        bool hit = false;
+        for (unsigned int i = cluster.first; i < cluster.first + cluster.count; ++i) {
+            double t;
+            if (decode(cluster, packed[i]).intersect(ray, t, tMin, tMax)) {
+                tMax = t;
+                tClosest = t;
+                index = (int)i;
+                hit = true;
+            }
+        }
+        return hit;
+    }
+    
+    // Shift every sphere by offset. Cluster origins are floats, so each cluster is
+    // re-quantized at its new position (radii are padded again, growing by at most
+    // one quantization step); packed indices keep their order.
+    void translate(const Vec3& offset) {
+        std::vector<Cluster> oldClusters;
+        std::vector<PackedSphere> oldPacked;
+        oldClusters.swap(clusters);
+        oldPacked.swap(packed);
+        packed.reserve(oldPacked.size());
+        std::vector<Sphere> decoded;
+        for (const Cluster& cluster : oldClusters) {
+            decoded.clear();
+            for (unsigned int i = cluster.first; i < cluster.first + cluster.count; ++i) {
+                Sphere sphere = decode(cluster, oldPacked[i]);
+                sphere.center = sphere.center + offset;
+                decoded.push_back(sphere);
+            }
+            addCluster(&decoded[0], decoded.size());
+        }
+    }
+    
+    // Decoded sphere at a packed index
+    Sphere sphere(int index) const {
+        return decode(clusters[clusterOf(index)], packed[index]);
+    }
+    
+    static AABB clusterBounds(const Cluster& cluster) {
+        return AABB(Vec3(cluster.boundsMin[0], cluster.boundsMin[1], cluster.boundsMin[2]),
+                    Vec3(cluster.boundsMax[0], cluster.boundsMax[1], cluster.boundsMax[2]));
+    }
+    
+    static Vec3 decodeCenter(const Cluster& cluster, const PackedSphere& p) {
+        return Vec3(cluster.origin[0] + p.x * (double)cluster.scale[0],
+                     cluster.origin[1] + p.y * (double)cluster.scale[1],
+                     cluster.origin[2] + p.z * (double)cluster.scale[2]);
+    }
+    
+    Sphere decode(const Cluster& cluster, const PackedSphere& p) const {
+        return Sphere(decodeCenter(cluster, p), p.radius * (double)cluster.radiusScale, palette[p.material]);
+    }
+    
+    // Nearest float at or below / at or above v
+    static float roundDown(double v) {
+        float f = (float)v;
+        return f > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+    static float roundUp(double v) {
+        float f = (float)v;
+        return f < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+    
+private:
+    std::map<std::tuple<double, double, double, int>, unsigned short> paletteLookup;
+    
+    size_t clusterOf(int index) const {
+        // Clusters are stored in packed order, so binary search on their first index
+        size_t lo = 0, hi = clusters.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (clusters[mid].first <= (unsigned int)index) lo = mid; else hi = mid;
+        }
+        return lo;
+    }
+    
+    unsigned short paletteIndex(const Material& material) {
+        std::tuple<double, double, double, int> key(material.color.x(), material.color.y(), material.color.z(), material.program);
+        std::map<std::tuple<double, double, double, int>, unsigned short>::const_iterator it = paletteLookup.find(key);
+        if (it != paletteLookup.end()) return it->second;
+        
+        if (palette.size() < 65536) {
+            unsigned short index = (unsigned short)palette.size();
+            palette.push_back(material);
+            paletteLookup[key] = index;
+            return index;
+        }
+        
+        // Palette full: fall back to the closest existing color with the same program
+        size_t best = 0;
+        double bestDist = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < palette.size(); ++i) {
+            if (palette[i].program != material.program) continue;
+            Vec3 d = palette[i].color - material.color;
+            if (d.dot(d) < bestDist) {
+                bestDist = d.dot(d);
+                best = i;
+            }
+        }
+        return (unsigned short)best;
+    }
+
+};
+
+// =========
+// BVH Class
+// =========
+// Work counters filled by the counted traversal paths
+struct TraversalStats {
+    long long rays;
+    long long nodesVisited;
+    long long primitiveTests;
+    
+    TraversalStats() : rays(0), nodesVisited(0), primitiveTests(0) {}
+};
+
+// Bounding volume hierarchy over primitive bounds, split with a binned surface
+// area heuristic. The BVH only stores indices; the caller supplies a leaf
+// intersector, so the same hierarchy works for any primitive array.
+//
+// Several primitive arrays can share one hierarchy: build() takes a small type
+// tag per primitive and never lets a leaf mix tags, so a leaf is a (type, index
+// range) pair. intersectLeaves() hands the caller whole leaves, which lets it
+// switch on the type once per leaf and run a loop specialised for that type
+// instead of paying an indirect call per primitive.
+//
+// In lazy mode build() only creates the root and nodes are split the first time
+// a ray reaches them, so build cost follows the part of the scene rays visit.
+// Traversal is thread-safe: exactly one thread wins the CAS that claims an
+// unsplit node, partitions its range and publishes the children with a release
+// store; threads reaching that node meanwhile wait for that node alone.
+class BVH {
+public:
+    enum NodeState {
+        NODE_UNSPLIT,   // Lazy mode: range and bounds known, children not built yet
+        NODE_SPLITTING, // Being split by one thread
+        NODE_INTERIOR,
+        NODE_LEAF
+    };
+    
+    struct Node {
+        AABB bounds;
+        int first, count; // Primitive range in `indices`
+        int left;         // Children are nodes[left] and nodes[left + 1]
+        short axis, depth;
+        std::atomic<int> state;
+        
+        Node() : first(0), count(0), left(-1), axis(0), depth(0), state(NODE_UNSPLIT) {}
+        Node(const Node& n) { *this = n; }
+        Node& operator=(const Node& n) {
+            bounds = n.bounds;
+            first = n.first;
+            count = n.count;
+            left = n.left;
+            axis = n.axis;
+            depth = n.depth;
+            state.store(n.state.load());
+            return *this;
+        }
+    };
+    
+    int maxLeafSize;
+    
+    BVH() : maxLeafSize(4), nodeCount(0), lazy(false) {}
+    BVH(const BVH& other) : nodeCount(0) { *this = other; }
+    BVH& operator=(const BVH& other) {
+        maxLeafSize = other.maxLeafSize;
+        lazy = other.lazy;
+        nodes = other.nodes;
+        indices = other.indices;
+        primBounds = other.primBounds;
+        primTypes = other.primTypes;
+        nodeCount.store(other.nodeCount.load());
+        return *this;
+    }
+    
+    // types, when given, holds one tag per primitive; leaves never mix tags
+    void build(const std::vector<AABB>& bounds, bool lazyBuild = false,
+               const std::vector<unsigned char>* types = 0) {
+        lazy = lazyBuild;
+        primBounds = bounds;
+        if (types) primTypes = *types; else primTypes.clear();
+        indices.resize(bounds.size());
+        for (size_t i = 0; i < indices.size(); ++i) indices[i] = (int)i;
+        
+        nodes.clear();
+        nodeCount.store(0);
+        if (bounds.empty()) return;
+        
+        // A binary tree with at least one primitive per leaf has < 2N nodes
+        nodes.resize(2 * bounds.size());
+        nodeCount.store(1);
+        Node& root = nodes[0];
+        root.first = 0;
+        root.count = (int)bounds.size();
+        for (const AABB& box : bounds) root.bounds.expand(box);
+        
+        if (!lazy) {
+            std::vector<int> pending(1, 0);
+            while (!pending.empty()) {
+                int index = pending.back();
+                pending.pop_back();
+                if (split(nodes[index]) == NODE_INTERIOR) {
+                    pending.push_back(nodes[index].left);
+                    pending.push_back(nodes[index].left + 1);
+                }
+            }
+            nodes.resize(nodeCount.load());
+            std::vector<Node>(nodes).swap(nodes); // Release the unused preallocation
+        }
+    }
+    
+    void clear() {
+        nodes.clear();
+        indices.clear();
+        primBounds.clear();
+        primTypes.clear();
+        nodeCount.store(0);
+    }
+    
+    size_t primitiveCount() const { return indices.size(); }
+    int builtNodeCount() const { return nodeCount.load(); }
+    bool isLazy() const { return lazy; }
+    
+    // Visit leaves front to back; leaf(primIndex, tMax) tests one primitive and
+    // returns true (after lowering tMax) when it finds a closer hit
+    template <class LeafIntersector>
+    bool intersect(const Ray& ray, double tMin, double& tMax, LeafIntersector& leaf) const {
+        EachPrimitive<LeafIntersector> ranges(leaf);
+        return traverse<false>(ray, tMin, tMax, ranges, 0);
+    }
+    
+    // Same as intersect, also counting visited nodes and primitive tests
+    template <class LeafIntersector>
+    bool intersectCounted(const Ray& ray, double tMin, double& tMax, LeafIntersector& leaf,
+                          TraversalStats& stats) const {
+        EachPrimitive<LeafIntersector> ranges(leaf);
+        return traverse<true>(ray, tMin, tMax, ranges, &stats);
+    }
+    
+    // Visit leaves front to back; leaf(type, primIndices, count, tMax) tests a
+    // whole leaf, whose primitives all carry the same type tag (0 when untyped)
+    template <class RangeIntersector>
+    bool intersectLeaves(const Ray& ray, double tMin, double& tMax, RangeIntersector& leaf) const {
+        return traverse<false>(ray, tMin, tMax, leaf, 0);
+    }
+    
+    template <class RangeIntersector>
+    bool intersectLeavesCounted(const Ray& ray, double tMin, double& tMax, RangeIntersector& leaf,
+                                TraversalStats& stats) const {
+        return traverse<true>(ray, tMin, tMax, leaf, &stats);
+    }
+    
+    // Call fn(primIndex) for every primitive whose bounds overlap region, an
+    // AABB or any type with bool overlaps(const AABB&) that is conservative
+    template <class Region, class Fn>
+    void forEachOverlapping(const Region& region, Fn& fn) const {
+        if (nodes.empty()) return;
+        
+        int stack[MAX_DEPTH + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            Node& node = nodes[stack[--stackSize]];
+            if (!region.overlaps(node.bounds)) continue;
+            
+            int state = node.state.load(std::memory_order_acquire);
+            if (state != NODE_INTERIOR && state != NODE_LEAF) state = splitShared(node);
+            
+            if (state == NODE_LEAF) {
+                for (int i = node.first; i < node.first + node.count; ++i) {
+                    if (region.overlaps(primBounds[indices[i]])) fn(indices[i]);
+                }
+            } else {
+                stack[stackSize++] = node.left;
+                stack[stackSize++] = node.left + 1;
+            }
+        }
+    }
+    
+    const Node& node(int index) const { return nodes[index]; }
+    
+    // Replace the primitive boxes (same count, same order) and recompute node
+    // bounds bottom-up, keeping the tree's shape. Far cheaper than build(), but
+    // the tree gets looser the further primitives move. Children are always
+    // allocated after their parent, so one reverse pass visits children first.
+    // Not safe while other threads traverse.
+    void refit(const std::vector<AABB>& bounds) {
+        primBounds = bounds;
+        for (int i = nodeCount.load() - 1; i >= 0; --i) {
+            Node& node = nodes[i];
+            node.bounds = AABB();
+            if (node.state.load(std::memory_order_relaxed) == NODE_INTERIOR) {
+                node.bounds.expand(nodes[node.left].bounds);
+                node.bounds.expand(nodes[node.left + 1].bounds);
+            } else {
+                for (int j = node.first; j < node.first + node.count; ++j) node.bounds.expand(primBounds[indices[j]]);
+            }
+        }
+    }
+    
+    // Move every node and primitive box by offset without rebuilding; unsplit
+    // lazy nodes stay unsplit. Not safe while other threads traverse.
+    // Boxes are absolute doubles in the scene's local frame, with no per-node
+    // origins: after Scene::rebase they are small near the camera, and the
+    // double slab test loses nothing on far nodes. Per-node origins would only
+    // pay off with float node boxes, which this tree does not have.
+    void translate(const Vec3& offset) {
+        int count = nodeCount.load();
+        for (int i = 0; i < count; ++i) nodes[i].bounds = nodes[i].bounds.translated(offset);
+        for (AABB& box : primBounds) box = box.translated(offset);
+    }
+    
+    size_t memoryBytes() const {
+        return nodes.capacity() * sizeof(Node) + indices.capacity() * sizeof(int) +
+               primBounds.capacity() * sizeof(AABB) + primTypes.capacity();
+    }
+    
+private:
+    static const int MAX_DEPTH = 96;   // Bounds the traversal stack
+    static const int SAH_BINS = 12;
+    static const int FORCE_MEDIAN_DEPTH = 60; // Deeper nodes split at the median, halving each level
+    
+    mutable std::vector<Node> nodes;
+    mutable std::vector<int> indices;
+    std::vector<AABB> primBounds;
+    std::vector<unsigned char> primTypes; // Empty when untyped
+    mutable std::atomic<int> nodeCount;
+    bool lazy;
+    
+    // Adapts a per-primitive leaf intersector to the per-leaf interface
+    template <class LeafIntersector>
+    struct EachPrimitive {
+        LeafIntersector& leaf;
+        explicit EachPrimitive(LeafIntersector& leaf) : leaf(leaf) {}
+        bool operator()(int, const int* prims, int count, double& tMax) {
+            bool hit = false;
+            for (int i = 0; i < count; ++i) {
+                if (leaf(prims[i], tMax)) hit = true;
+            }
+            return hit;
+        }
+    };
+    
+    int leafType(const Node& node) const { return primTypes.empty() ? 0 : primTypes[indices[node.first]]; }
+    
+    template <bool CountStats, class RangeIntersector>
+    bool traverse(const Ray& ray, double tMin, double& tMax, RangeIntersector& leaf, TraversalStats* stats) const {
+        if (nodes.empty()) return false;
+        
+        Vec3 invDir = AABB::inverseDirection(ray);
+        bool dirIsNeg[3] = { invDir.x() < 0, invDir.y() < 0, invDir.z() < 0 };
+        int stack[MAX_DEPTH + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        bool hit = false;
+        
+        while (stackSize > 0) {
+            int index = stack[--stackSize];
+            Node& node = nodes[index];
+            if (CountStats) stats->nodesVisited++;
+            if (!node.bounds.intersect(ray, invDir, tMin, tMax)) continue;
+            
+            int state = node.state.load(std::memory_order_acquire);
+            if (state != NODE_INTERIOR && state != NODE_LEAF) state = splitShared(node);
+            
+            if (state == NODE_LEAF) {
+                if (CountStats) stats->primitiveTests += node.count;
+                if (leaf(leafType(node), &indices[node.first], node.count, tMax)) hit = true;
+            } else if (dirIsNeg[node.axis]) {
+                stack[stackSize++] = node.left;
+                stack[stackSize++] = node.left + 1;
+            } else {
+                stack[stackSize++] = node.left + 1;
+                stack[stackSize++] = node.left;
+            }
+        }
+        return hit;
+    }
+    
+    // Split a node some ray reached first; returns its published state
+    int splitShared(Node& node) const {
+        int expected = NODE_UNSPLIT;
+        if (node.state.compare_exchange_strong(expected, NODE_SPLITTING, std::memory_order_acq_rel)) {
+            return split(node);
+        }
+        int state;
+        while ((state = node.state.load(std::memory_order_acquire)) == NODE_SPLITTING) {
+            std::this_thread::yield();
+        }
+        return state;
+    }
+    
+    // Partition the node's range, create its children (unsplit in lazy mode) and publish the result
+    int split(Node& node) const {
+        int state = NODE_LEAF;
+        int mid = partition(node);
+        if (mid == node.first) mid = typeSplit(node);
+        if (mid > node.first && mid < node.first + node.count) {
+            int left = nodeCount.fetch_add(2);
+            initChild(nodes[left], node.first, mid - node.first, node.depth + 1);
+            initChild(nodes[left + 1], mid, node.first + node.count - mid, node.depth + 1);
+            node.left = left;
+            state = NODE_INTERIOR;
+        }
+        node.state.store(state, std::memory_order_release);
+        return state;
+    }
+    
+    void initChild(Node& child, int first, int count, int depth) const {
+        child.first = first;
+        child.count = count;
+        child.depth = (short)depth;
+        child.bounds = AABB();
+        for (int i = first; i < first + count; ++i) child.bounds.expand(primBounds[indices[i]]);
+        child.state.store(NODE_UNSPLIT, std::memory_order_relaxed);
+    }
+    
+    // Binned SAH partition of the node's range; returns the split position,
+    // or node.first when the node should stay a leaf
+    int partition(Node& node) const {
+        if (node.count <= 1) return node.first;
+        
+        AABB centroids;
+        for (int i = node.first; i < node.first + node.count; ++i) {
+            centroids.expand(primBounds[indices[i]].center());
+        }
+        Vec3 extent = centroids.extent();
+        int axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 0 : (extent.y() >= extent.z() ? 1 : 2);
+        double lo = component(centroids.pMin, axis);
+        double width = component(extent, axis);
+        node.axis = (short)axis;
+        if (width <= 0) {
+            // All centroids coincide; only split when the leaf would be too big
+            return node.count > maxLeafSize ? node.first + node.count / 2 : node.first;
+        }
+        if (node.depth >= FORCE_MEDIAN_DEPTH) return medianSplit(node, axis);
+        
+        int binCounts[SAH_BINS] = {};
+        AABB binBounds[SAH_BINS];
+        for (int i = node.first; i < node.first + node.count; ++i) {
+            const AABB& box = primBounds[indices[i]];
+            int b = binOf(component(box.center(), axis), lo, width);
+            binCounts[b]++;
+            binBounds[b].expand(box);
+        }
+        
+        // Sweep from the right to get the cost of every split plane
+        double rightArea[SAH_BINS];
+        int rightCount[SAH_BINS];
+        AABB acc;
+        int count = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            acc.expand(binBounds[b]);
+            count += binCounts[b];
+            rightArea[b] = acc.surfaceArea();
+            rightCount[b] = count;
+        }
+        acc = AABB();
+        count = 0;
+        int bestBin = -1;
+        double bestCost = std::numeric_limits<double>::infinity();
+        for (int b = 1; b < SAH_BINS; ++b) {
+            acc.expand(binBounds[b - 1]);
+            count += binCounts[b - 1];
+            if (count == 0 || rightCount[b] == 0) continue;
+            double cost = acc.surfaceArea() * count + rightArea[b] * rightCount[b];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestBin = b;
+            }
+        }
+        
+        // Traversal step costs about one primitive test
+        double leafCost = node.count;
+        double splitCost = 1.0 + bestCost / node.bounds.surfaceArea();
+        if (bestBin < 0 || (node.count <= maxLeafSize && splitCost >= leafCost)) {
+            return node.count > maxLeafSize ? medianSplit(node, axis) : node.first;
+        }
+        
+        int* mid = std::partition(&indices[node.first], &indices[node.first] + node.count,
+                                  BinPredicate(primBounds, axis, lo, width, bestBin));
+        return (int)(mid - &indices[0]);
+    }
+    
+    // A would-be leaf holding several types splits off the first primitive's type
+    int typeSplit(const Node& node) const {
+        if (primTypes.empty()) return node.first;
+        int* begin = &indices[node.first];
+        int* mid = std::partition(begin, begin + node.count, SameType(primTypes, primTypes[*begin]));
+        return (int)(mid - &indices[0]);
+    }
+    
+    int medianSplit(const Node& node, int axis) const {
+        int* begin = &indices[node.first];
+        std::nth_element(begin, begin + node.count / 2, begin + node.count, CentroidLess(primBounds, axis));
+        return node.first + node.count / 2;
+    }
+    
+    static double component(const Vec3& v, int axis) { return axis == 0 ? v.x() : (axis == 1 ? v.y() : v.z()); }
+    
+    static int binOf(double c, double lo, double width) {
+        int b = (int)(SAH_BINS * (c - lo) / width);
+        return std::min(std::max(b, 0), SAH_BINS - 1);
+    }
+    
+    struct BinPredicate {
+        const std::vector<AABB>& bounds;
+        int axis, bin;
+        double lo, width;
+        BinPredicate(const std::vector<AABB>& bounds, int axis, double lo, double width, int bin)
+            : bounds(bounds), axis(axis), bin(bin), lo(lo), width(width) {}
+        bool operator()(int i) const { return binOf(component(bounds[i].center(), axis), lo, width) < bin; }
+    };
+    
+    struct SameType {
+        const std::vector<unsigned char>& types;
+        unsigned char type;
+        SameType(const std::vector<unsigned char>& types, unsigned char type) : types(types), type(type) {}
+        bool operator()(int i) const { return types[i] == type; }
+    };
+    
+    struct CentroidLess {
+        const std::vector<AABB>& bounds;
+        int axis;
+        CentroidLess(const std::vector<AABB>& bounds, int axis) : bounds(bounds), axis(axis) {}
+        bool operator()(int a, int b) const {
+            return component(bounds[a].center(), axis) < component(bounds[b].center(), axis);
+        }
+    };
+};
+
+// ==================
+// Particle Set Class
+// ==================
+namespace Morton {
+    // Spread the low 10 bits of v so two zero bits separate each of them
+    inline unsigned int expandBits(unsigned int v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+    
+    // 30-bit Morton code of a point in the unit cube
+    inline unsigned int code(const Vec3& p) {
+        unsigned int x = (unsigned int)std::min(std::max(p.x() * 1024.0, 0.0), 1023.0);
+        unsigned int y = (unsigned int)std::min(std::max(p.y() * 1024.0, 0.0), 1023.0);
+        unsigned int z = (unsigned int)std::min(std::max(p.z() * 1024.0, 0.0), 1023.0);
+        return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+    }
+}
+
+// Large numbers of spheres sharing one radius, e.g. simulation dumps: 12-byte
+// float positions relative to a double origin, plus an optional RGBA8 color
+// (16 bytes per particle with colors).
+//
+// build() sorts particles along a Morton curve and groups them into blocks of
+// LEAF_SIZE. The hierarchy is an implicit binary tree over the blocks, stored
+// in heap order. Node i covers a block range found by halving the root range,
+// so nodes hold only a float box. That adds at most 6 bytes per particle,
+// and the tree needs no index array or per-particle boxes. The leaf kernel
+// tests a whole block against the shared radius.
+//
+// translate() only moves the origin: positions and node boxes are local. Scene
+// storage indices are ints, which caps one scene at 2^31 spheres in total.
+class ParticleSet {
+public:
+    struct Position {
+        float x, y, z;
+    };
+    
+    static const int LEAF_SIZE = 16;
+    
+    Vec3 origin;                      // World position that particle positions are relative to
+    double radius;
+    Material material;                // Color of every particle when no RGBA colors are given
+    std::vector<Position> positions;
+    std::vector<unsigned int> colors; // Optional RGBA8 per particle (R in the low byte); empty or one per particle
+    
+    ParticleSet() : radius(0.01) {}
+    
+    bool empty() const { return positions.empty(); }
+    size_t size() const { return positions.size(); }
+    size_t memoryBytes() const {
+        return positions.capacity() * sizeof(Position) + colors.capacity() * sizeof(unsigned int) +
+               nodes.capacity() * sizeof(Node);
+    }
+    
+    static unsigned int packRGBA(const Vec3& color, double alpha = 1.0) {
+        return channel(color.x()) | (channel(color.y()) << 8) | (channel(color.z()) << 16) | (channel(alpha) << 24);
+    }
+    
+    // Append a particle at a world position. Once any particle has a color,
+    // uncolored ones (earlier or later) get the material color, so colors
+    // stays empty or one per particle.
+    void add(const Vec3& position) {
+        Vec3 p = position - origin;
+        Position local = { (float)p.x(), (float)p.y(), (float)p.z() };
+        positions.push_back(local);
+        if (!colors.empty()) padColors();
+    }
+    void add(const Vec3& position, unsigned int rgba) {
+        Vec3 p = position - origin;
+        Position local = { (float)p.x(), (float)p.y(), (float)p.z() };
+        positions.push_back(local);
+        padColors();
+        colors.back() = rgba;
+    }
+    
+    // Sort particles spatially and build the hierarchy; call after adding particles
+    void build() {
+        nodes.clear();
+        if (positions.empty()) return;
+        
+        AABB extent;
+        for (const Position& p : positions) extent.expand(Vec3(p.x, p.y, p.z));
+        Vec3 size = extent.extent();
+        Vec3 scale(size.x() > 0 ? 1.0 / size.x() : 0.0, size.y() > 0 ? 1.0 / size.y() : 0.0, size.z() > 0 ? 1.0 / size.z() : 0.0);
+        std::vector<std::pair<unsigned int, unsigned int> > keys(positions.size());
+        for (size_t i = 0; i < positions.size(); ++i) {
+            Vec3 p = (Vec3(positions[i].x, positions[i].y, positions[i].z) - extent.pMin) * scale;
+            keys[i] = std::make_pair(Morton::code(p), (unsigned int)i);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<Position> sorted(positions.size());
+        for (size_t i = 0; i < keys.size(); ++i) sorted[i] = positions[keys[i].second];
+        positions.swap(sorted);
+        if (!colors.empty()) {
+            padColors();
+            std::vector<unsigned int> sortedColors(colors.size());
+            for (size_t i = 0; i < keys.size(); ++i) sortedColors[i] = colors[keys[i].second];
+            colors.swap(sortedColors);
+        }
+        
+        size_t levelSize = 1;
+        while (levelSize < blockCount()) levelSize *= 2;
+        nodes.assign(2 * levelSize - 1, Node());
+        buildNode(0, 0, blockCount());
+    }
+    
+    void translate(const Vec3& offset) { origin = origin + offset; }
+    
+    Sphere sphere(size_t index) const {
+        const Position& p = positions[index];
+        Material m = index < colors.size() ? Material(unpackRGB(colors[index]), material.program) : material;
+        return Sphere(origin + Vec3(p.x, p.y, p.z), radius, m);
+    }
+    
+    // Closest hit in [tMin, tMax]
+    template <bool CountStats>
+    bool intersect(const Ray& ray, double& tClosest, int& index, double tMin, double tMax,
+                   TraversalStats* stats) const {
+        if (nodes.empty()) return false;
+        
+        // Work in the set's local frame, where positions and node boxes live
+        Ray local(ray.origin - origin, ray.direction);
+        Vec3 invDir = AABB::inverseDirection(local);
+        double a = local.direction.dot(local.direction);
+        double invA = 1.0 / a;
+        double r2 = radius * radius;
+        
+        // Child boxes are tested when pushed; popping only rechecks the entry distance
+        struct Entry { int node; size_t lo, hi; double tEntry; };
+        Entry stack[2 * 64];
+        int stackSize = 0;
+        Entry root = { 0, 0, blockCount(), 0.0 };
+        if (!boxEntry(0, local, invDir, tMin, tMax, root.tEntry)) return false;
+        stack[stackSize++] = root;
+        bool hit = false;
+        while (stackSize > 0) {
+            Entry e = stack[--stackSize];
+            if (e.tEntry > tMax) continue;
+            if (CountStats) stats->nodesVisited++;
+            
+            if (e.hi - e.lo == 1) {
+                size_t first = e.lo * LEAF_SIZE;
+                size_t last = std::min(first + LEAF_SIZE, positions.size());
+                if (CountStats) stats->primitiveTests += last - first;
+                for (size_t i = first; i < last; ++i) {
+                    double ox = local.origin.x() - positions[i].x;
+                    double oy = local.origin.y() - positions[i].y;
+                    double oz = local.origin.z() - positions[i].z;
+                    double b = ox * local.direction.x() + oy * local.direction.y() + oz * local.direction.z();
+                    double c = ox * ox + oy * oy + oz * oz - r2;
+                    double discriminant = b * b - a * c;
+                    if (discriminant < 0) continue;
+                    double sqrtd = std::sqrt(discriminant);
+                    double t = (-b - sqrtd) * invA;
+                    if (t < tMin) t = (-b + sqrtd) * invA;
+                    if (t >= tMin && t <= tMax) {
+                        tMax = t;
+                        tClosest = t;
+                        index = (int)i;
+                        hit = true;
+                    }
+                }
+                continue;
+            }
+            
+            // Visit the nearer child first
+            size_t mid = e.lo + (e.hi - e.lo + 1) / 2;
+            Entry left = { 2 * e.node + 1, e.lo, mid, 0.0 };
+            Entry right = { 2 * e.node + 2, mid, e.hi, 0.0 };
+            bool hitLeft = boxEntry(left.node, local, invDir, tMin, tMax, left.tEntry);
+            bool hitRight = boxEntry(right.node, local, invDir, tMin, tMax, right.tEntry);
+            if (hitLeft && hitRight) {
+                bool leftFirst = left.tEntry <= right.tEntry;
+                stack[stackSize++] = leftFirst ? right : left;
+                stack[stackSize++] = leftFirst ? left : right;
+            } else if (hitLeft) {
+                stack[stackSize++] = left;
+            } else if (hitRight) {
+                stack[stackSize++] = right;
+            }
+        }
+        return hit;
+    }
+    
+    // Call fn(index) for every particle whose bounds overlap a world-space region
+    // (see BVH::forEachOverlapping); the region also needs translated(offset)
+    template <class Region, class Fn>
+    void forEachOverlapping(const Region& region, Fn& fn) const {
+        if (nodes.empty()) return;
+        Region local = region.translated(Vec3(0, 0, 0) - origin);
+        struct Entry { int node; size_t lo, hi; };
+        Entry stack[2 * 64];
+        int stackSize = 0;
+        Entry root = { 0, 0, blockCount() };
+        stack[stackSize++] = root;
+        while (stackSize > 0) {
+            Entry e = stack[--stackSize];
+            if (!local.overlaps(nodeBox(e.node))) continue;
+            if (e.hi - e.lo == 1) {
+                size_t first = e.lo * LEAF_SIZE;
+                size_t last = std::min(first + LEAF_SIZE, positions.size());
+                for (size_t i = first; i < last; ++i) {
+                    if (local.overlaps(particleBox(positions[i]))) fn((int)i);
+                }
+                continue;
+            }
+            size_t mid = e.lo + (e.hi - e.lo + 1) / 2;
+            Entry left = { 2 * e.node + 1, e.lo, mid };
+            Entry right = { 2 * e.node + 2, mid, e.hi };
+            stack[stackSize++] = left;
+            stack[stackSize++] = right;
+        }
+    }
+    
+private:
+    struct Node {
+        float boundsMin[3], boundsMax[3];
+    };
+    
+    std::vector<Node> nodes; // Heap order: children of i are 2i + 1 and 2i + 2
+    
+    size_t blockCount() const { return (positions.size() + LEAF_SIZE - 1) / LEAF_SIZE; }
+    
+    AABB nodeBox(int node) const {
+        const Node& n = nodes[node];
+        return AABB(Vec3(n.boundsMin[0], n.boundsMin[1], n.boundsMin[2]),
+                    Vec3(n.boundsMax[0], n.boundsMax[1], n.boundsMax[2]));
+    }
+    
+    AABB particleBox(const Position& p) const {
+        Vec3 r(radius, radius, radius);
+        return AABB(Vec3(p.x, p.y, p.z) - r, Vec3(p.x, p.y, p.z) + r);
+    }
+    
+    // Slab test against a node box that also reports where the ray enters it
+    bool boxEntry(int node, const Ray& ray, const Vec3& invDir, double tMin, double tMax, double& tEntry) const {
+        const Node& n = nodes[node];
+        AABB::clipSlab(n.boundsMin[0], n.boundsMax[0], ray.origin.x(), invDir.x(), tMin, tMax);
+        AABB::clipSlab(n.boundsMin[1], n.boundsMax[1], ray.origin.y(), invDir.y(), tMin, tMax);
+        AABB::clipSlab(n.boundsMin[2], n.boundsMax[2], ray.origin.z(), invDir.z(), tMin, tMax);
+        tEntry = tMin;
+        return tMin <= tMax;
+    }
+    
+    // Bounds of blocks [lo, hi), rounded outward to float
+    AABB buildNode(int node, size_t lo, size_t hi) {
+        AABB box;
+        if (hi - lo == 1) {
+            size_t first = lo * LEAF_SIZE;
+            size_t last = std::min(first + LEAF_SIZE, positions.size());
+            for (size_t i = first; i < last; ++i) box.expand(particleBox(positions[i]));
+        } else {
+            size_t mid = lo + (hi - lo + 1) / 2;
+            box.expand(buildNode(2 * node + 1, lo, mid));
+            box.expand(buildNode(2 * node + 2, mid, hi));
+        }
+        Node& n = nodes[node];
+        n.boundsMin[0] = CompactSphereSet::roundDown(box.pMin.x());
+        n.boundsMin[1] = CompactSphereSet::roundDown(box.pMin.y());
+        n.boundsMin[2] = CompactSphereSet::roundDown(box.pMin.z());
+        n.boundsMax[0] = CompactSphereSet::roundUp(box.pMax.x());
+        n.boundsMax[1] = CompactSphereSet::roundUp(box.pMax.y());
+        n.boundsMax[2] = CompactSphereSet::roundUp(box.pMax.z());
+        return box;
+    }
+    
+    // Give every particle without a color the material color
+    void padColors() { colors.resize(positions.size(), packRGBA(material.color)); }
+    
+    static unsigned int channel(double v) {
+        return (unsigned int)(std::min(std::max(v, 0.0), 1.0) * 255.0 + 0.5);
+    }
+    static Vec3 unpackRGB(unsigned int rgba) {
+        return Vec3((rgba & 0xFF) / 255.0, ((rgba >> 8) & 0xFF) / 255.0, ((rgba >> 16) & 0xFF) / 255.0);
+    }
+};
+
+// ===========
+// Light Class
+// ===========
+class Light {
+public:
+    Vec3 position;
+    Vec3 color;
+    double intensity;
+    
+    Light(const Vec3& position, const Vec3& color = Vec3(1, 1, 1), double intensity = 1.0)
+        : position(position), color(color), intensity(intensity) {}
+};
+
+// ===========
+// Scene Class
+// ===========
+class Scene {
+public:
+    std::vector<Sphere> spheres;
+    CompactSphereSet compactSpheres; // Quantized spheres; storage indices continue after `spheres`
+    ParticleSet particles;           // Uniform-radius particles; storage indices continue after `compactSpheres`
+    std::vector<Quadric> quadrics;   // Storage indices continue after `particles`
+    std::vector<CSGShape> csgShapes; // Every CSG leaf gets a storage index, after `quadrics`
+    std::vector<int> csgFirstLeaf;   // Per shape: offset of its first leaf in the CSG index range
+    BVH bvh;                         // Over `spheres`, `quadrics` and `csgShapes`, in that order and
+                                     // tagged by PrimitiveType; ignored once it no longer matches them
+    std::vector<Light> lights;
+    std::vector<MaterialProgram> materialPrograms; // Referenced by Material::program
+    Vec3 ambientLight;
+    Vec3 worldOrigin;                // World position of the local origin all stored coordinates use
+    
+    // Index remap between storage order and the IDs handed out by addSphere,
+    // so sphere IDs stay stable when reorderSpheres() moves spheres around
+    std::vector<int> sphereIds;   // storage index -> sphere ID
+    std::vector<int> sphereSlots; // sphere ID -> storage index
+    
+    Scene() : ambientLight(0.1, 0.1, 0.1) { std::fill(bvhTypeCounts, bvhTypeCounts + PRIM_TYPE_COUNT, 0); }
+    
+    // Returns the sphere's ID (its insertion order)
+    int addSphere(const Sphere& sphere) {
+        int id = (int)sphereSlots.size();
+        sphereSlots.push_back((int)spheres.size());
+        sphereIds.push_back(id);
+        spheres.push_back(sphere);
+        return id;
+    }
+    void addLight(const Light& light) { lights.push_back(light); }
+    
+    // Returns the quadric's storage index
+    int addQuadric(const Quadric& quadric) {
+        quadrics.push_back(quadric);
+        return sphereCount() + (int)quadrics.size() - 1;
+    }
+    
+    // Returns the number to put in Material::program
+    int addMaterialProgram(const MaterialProgram& program) {
+        materialPrograms.push_back(program);
+        return (int)materialPrograms.size() - 1;
+    }
+    
+    // Surface color of a material at one point. Each call with a program sets up
+    // a whole batch; renderers and the Relighter batch programs per row instead.
+    Vec3 materialColor(const Material& material, const Vec3& point, const Vec3& normal) const {
+        if (material.program < 0) return material.color;
+        return materialPrograms[material.program].evaluate(point, normal, material.color);
+    }
+    
+    // Returns the shape's index, or -1 for a shape with no nodes, which has no
+    // bounds to place in the BVH
+    int addCSG(const CSGShape& shape) {
+        if (shape.root < 0 || shape.root >= (int)shape.nodes.size()) return -1;
+        int leaves = csgShapes.empty() ? 0 : csgFirstLeaf.back() + (int)csgShapes.back().leaves.size();
+        csgFirstLeaf.push_back(leaves);
+        csgShapes.push_back(shape);
+        csgShapes.back().finish();
+        return (int)csgShapes.size() - 1;
+    }
+    
+    // Storage index <-> sphere ID; spheres pushed directly onto `spheres`
+    // without addSphere keep their storage index as ID
+    int sphereId(int index) const { return index < (int)sphereIds.size() ? sphereIds[index] : index; }
+    int sphereIndex(int id) const { return id < (int)sphereSlots.size() ? sphereSlots[id] : id; }
+    
+    // Number of storage indices, compact spheres and particles included
+    int sphereCount() const { return (int)(spheres.size() + compactSpheres.size() + particles.size()); }
+    
+    // Quadrics take the storage indices after every kind of sphere, then come CSG leaves
+    bool isSphere(int index) const { return index < sphereCount(); }
+    bool isQuadric(int index) const { return !isSphere(index) && index < csgBase(); }
+    bool isCSG(int index) const { return index >= csgBase(); }
+    const Quadric& getQuadric(int index) const { return quadrics[index - sphereCount()]; }
+    int csgBase() const { return sphereCount() + (int)quadrics.size(); }
+    
+    // CSG storage index -> shape number
+    int csgShapeOf(int index) const {
+        return (int)(std::upper_bound(csgFirstLeaf.begin(), csgFirstLeaf.end(), index - csgBase()) -
+                     csgFirstLeaf.begin()) - 1;
+    }
+    
+    // Bounds of the primitive at a storage index (the whole shape for CSG leaves)
+    AABB primitiveBounds(int index) const {
+        if (isSphere(index)) return getSphere(index).bounds();
+        if (isQuadric(index)) return getQuadric(index).bounds();
+        return csgShapes[csgShapeOf(index)].bounds();
+    }
+    
+    // Primitive arrays sharing `bvh`; each BVH leaf holds one type only. A
+    // PRIM_CLUSTER primitive is a whole compactSpheres cluster.
+    enum PrimitiveType { PRIM_SPHERE, PRIM_QUADRIC, PRIM_CSG, PRIM_CLUSTER, PRIM_TYPE_COUNT };
+    
+    // Primitive kinds a query is compiled for, as a template argument of
+    // intersect, surfaceAt and isInShadow. Regular spheres are always included;
+    // each bit adds a kind, and code for the others is compiled out.
+    // PRIMS_UNINDEXED: the BVH does not match the scene, so test every primitive.
+    // PRIMS_CHECKED: decide between BVH and linear tests on each call, as the
+    // untemplated queries do. Renderers pick a mask once with primitiveKinds().
+    enum PrimitiveKinds {
+        PRIMS_SPHERES = 0,
+        PRIMS_QUADRICS = 1,
+        PRIMS_CSG = 2,
+        PRIMS_CLUSTERS = 4,
+        PRIMS_PARTICLES = 8,
+        PRIMS_ALL = 15,
+        PRIMS_UNINDEXED = 16,
+        PRIMS_CHECKED = 32
+    };
+    
+    // Kinds present now, plus PRIMS_UNINDEXED when the BVH is missing or stale
+    unsigned primitiveKinds() const {
+        unsigned kinds = PRIMS_SPHERES;
+        if (!quadrics.empty()) kinds |= PRIMS_QUADRICS;
+        if (!csgShapes.empty()) kinds |= PRIMS_CSG;
+        if (!compactSpheres.empty()) kinds |= PRIMS_CLUSTERS;
+        if (!particles.empty()) kinds |= PRIMS_PARTICLES;
+        if (!bvhMatchesScene()) kinds |= PRIMS_UNINDEXED;
+        return kinds;
+    }
+    
+    // Build the hierarchy over `spheres`, `quadrics`, `csgShapes` and the clusters of
+    // `compactSpheres`; rebuild after adding or moving them. A lazy build only creates
+    // the root and splits nodes as rays reach them.
+    void buildBVH(bool lazy = false, int maxLeafSize = 4) {
+        std::vector<AABB> bounds;
+        std::vector<unsigned char> types;
+        collectBVHPrimitives(bounds, &types);
+        bvh.maxLeafSize = maxLeafSize;
+        bvh.build(bounds, lazy, &types);
+        bvhTypeCounts[PRIM_SPHERE] = spheres.size();
+        bvhTypeCounts[PRIM_QUADRIC] = quadrics.size();
+        bvhTypeCounts[PRIM_CSG] = csgShapes.size();
+        bvhTypeCounts[PRIM_CLUSTER] = compactSpheres.clusters.size();
+    }
+    
+    // After moving (not adding or removing) spheres, quadrics or CSG shapes: update
+    // the hierarchy's boxes in place. Falls back to buildBVH when it no longer matches.
+    void refitBVH() {
+        if (!bvhMatchesScene()) {
+            buildBVH(bvh.isLazy(), bvh.maxLeafSize);
+            return;
+        }
+        std::vector<AABB> bounds;
+        collectBVHPrimitives(bounds, 0);
+        bvh.refit(bounds);
+    }
+    
+    size_t bvhPrimitiveCount() const {
+        return spheres.size() + quadrics.size() + csgShapes.size() + compactSpheres.clusters.size();
+    }
+    // The tree's type tags and storage offsets hold only while each type's count
+    // is the one it was built with; equal totals are not enough
+    bool bvhMatchesScene() const {
+        return bvh.primitiveCount() == bvhPrimitiveCount() && bvhTypeCounts[PRIM_SPHERE] == spheres.size() &&
+               bvhTypeCounts[PRIM_QUADRIC] == quadrics.size() && bvhTypeCounts[PRIM_CSG] == csgShapes.size() &&
+               bvhTypeCounts[PRIM_CLUSTER] == compactSpheres.clusters.size();
+    }
+    
+    // Move the local origin to a new world position, e.g. next to the camera, so
+    // intersection math runs on small coordinates far from the world origin.
+    // Spheres, lights, the compact set and the BVH shift in place. Returns the
+    // offset added to local coordinates; translate cameras by it too, and clear
+    // any LightVisibilityCache, whose grid is keyed on local coordinates.
+    Vec3 rebase(const Vec3& newWorldOrigin) {
+        Vec3 offset = worldOrigin - newWorldOrigin;
+        for (Sphere& sphere : spheres) sphere.center = sphere.center + offset;
+        for (Light& light : lights) light.position = light.position + offset;
+        if (!compactSpheres.empty()) compactSpheres.translate(offset);
+        particles.translate(offset);
+        for (Quadric& quadric : quadrics) quadric.translate(offset);
+        for (CSGShape& shape : csgShapes) shape.translate(offset);
+        bvh.translate(offset);
+        // Re-quantized clusters can grow by a step, so their boxes are refreshed
+        if (!compactSpheres.empty() && bvhMatchesScene()) refitBVH();
+        worldOrigin = newWorldOrigin;
+        return offset;
+    }
+    
+    Vec3 toWorld(const Vec3& local) const { return local + worldOrigin; }
+    Vec3 toLocal(const Vec3& world) const { return world - worldOrigin; }
+    
+    // Sort sphere storage along a Morton (Z-order) curve of the sphere centers,
+    // so spheres that are close in space are close in memory. Storage indices
+    // change and the BVH is cleared; rebuild it before rendering. LightBake and
+    // LightVisibilityCache are keyed by sphere ID and stay valid; sphere id
+    // buffers hold storage indices, so call invalidateHistory() on a
+    // CheckerboardRenderer.
+    void reorderSpheres() {
+        if (spheres.size() < 2) return;
+        
+        // Adopt spheres added behind addSphere's back
+        while (sphereIds.size() < spheres.size()) {
+            sphereIds.push_back((int)sphereSlots.size());
+            sphereSlots.push_back((int)sphereIds.size() - 1);
+        }
+        
+        AABB centerBounds;
+        for (const Sphere& sphere : spheres) centerBounds.expand(sphere.center);
+        Vec3 extent = centerBounds.extent();
+        Vec3 scale(extent.x() > 0 ? 1.0 / extent.x() : 0.0,
+                   extent.y() > 0 ? 1.0 / extent.y() : 0.0,
+                   extent.z() > 0 ? 1.0 / extent.z() : 0.0);
+        
+        std::vector<std::pair<unsigned int, int> > keys(spheres.size());
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            Vec3 p = (spheres[i].center - centerBounds.pMin) * scale;
+            keys[i] = std::make_pair(Morton::code(p), (int)i);
+        }
+        std::sort(keys.begin(), keys.end());
+        
+        std::vector<Sphere> sorted;
+        std::vector<int> sortedIds;
+        sorted.reserve(spheres.size());
+        sortedIds.reserve(spheres.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sorted.push_back(spheres[keys[i].second]);
+            sortedIds.push_back(sphereIds[keys[i].second]);
+            sphereSlots[sortedIds.back()] = (int)i;
+        }
+        spheres.swap(sorted);
+        sphereIds.swap(sortedIds);
+        bvh.clear();
+    }
+    
+    // Sphere at a storage index, decoding compact spheres
+    Sphere getSphere(int index) const { return getSphere<PRIMS_ALL>(index); }
+    template <unsigned Prims>
+    Sphere getSphere(int index) const {
+        if (!(Prims & (PRIMS_CLUSTERS | PRIMS_PARTICLES)) || index < (int)spheres.size()) return spheres[index];
+        int compactIndex = index - (int)spheres.size();
+        if (compactIndex < (int)compactSpheres.size()) return compactSpheres.sphere(compactIndex);
+        return particles.sphere(compactIndex - compactSpheres.size());
+    }
+    
+    // Find closest intersection with any sphere; sphereIndex is a storage index
+    bool intersect(const Ray& ray, double& tClosest, int& sphereIndex, double tMin = 0.001) const {
+        return intersectSpheres<false>(ray, tClosest, sphereIndex, tMin, 0);
+    }
+    // Same, compiled for a PrimitiveKinds mask that must cover the scene
+    template <unsigned Prims>
+    bool intersect(const Ray& ray, double& tClosest, int& sphereIndex, double tMin = 0.001) const {
+        return intersectSpheres<false, Prims>(ray, tClosest, sphereIndex, tMin, 0);
+    }
+    
+    // Same as intersect, also counting the traversal work
+    bool intersectCounted(const Ray& ray, double& tClosest, int& sphereIndex, TraversalStats& stats,
+                          double tMin = 0.001) const {
+        return intersectSpheres<true>(ray, tClosest, sphereIndex, tMin, &stats);
+    }
+    
+    template <bool CountStats, unsigned Prims = PRIMS_ALL | PRIMS_CHECKED>
+    bool intersectSpheres(const Ray& ray, double& tClosest, int& sphereIndex, double tMin,
+                          TraversalStats* stats) const {
+        tClosest = std::numeric_limits<double>::infinity();
+        sphereIndex = -1;
+        if (CountStats) stats->rays++;
+        
+        LeafDispatch<Prims> leaf(*this, ray, tMin);
+        bool indexed = (Prims & PRIMS_CHECKED) ? bvhMatchesScene() : !(Prims & PRIMS_UNINDEXED);
+        if (indexed) {
+            if (CountStats) {
+                bvh.intersectLeavesCounted(ray, tMin, tClosest, leaf, *stats);
+            } else {
+                bvh.intersectLeaves(ray, tMin, tClosest, leaf);
+            }
+        } else {
+            if (CountStats) stats->primitiveTests += bvhPrimitiveCount();
+            int quadricStart = (int)spheres.size(), shapeStart = quadricStart + (int)quadrics.size();
+            int clusterStart = shapeStart + (int)csgShapes.size();
+            leaf.testSpheres(Sequential(0), quadricStart, tClosest);
+            if (Prims & PRIMS_QUADRICS) leaf.testQuadrics(Sequential(quadricStart), (int)quadrics.size(), tClosest);
+            if (Prims & PRIMS_CSG) leaf.testShapes(Sequential(shapeStart), (int)csgShapes.size(), tClosest);
+            if (Prims & PRIMS_CLUSTERS) {
+                leaf.testClusters(Sequential(clusterStart), (int)compactSpheres.clusters.size(), tClosest);
+            }
+        }
+        sphereIndex = leaf.hitIndex;
+        
+        int particleIndex;
+        if ((Prims & PRIMS_PARTICLES) && !particles.empty() &&
+            particles.intersect<CountStats>(ray, tClosest, particleIndex, tMin, tClosest, stats)) {
+            sphereIndex = (int)(spheres.size() + compactSpheres.size()) + particleIndex;
+        }
+        
+        return sphereIndex != -1;
+    }
+    
+    // Call fn(storageIndex) for every primitive whose bounds overlap region, an
+    // AABB or a tighter conservative shape (see BVH::forEachOverlapping). A CSG
+    // shape reports only its first leaf; primitiveBounds covers the whole shape
+    template <class Region, class Fn>
+    void forEachSphereOverlapping(const Region& region, Fn& fn) const {
+        // A cluster primitive reports each of its spheres that overlaps region
+        const Scene& scene = *this;
+        int clusterStart = (int)(spheres.size() + quadrics.size() + csgShapes.size());
+        auto mapped = [&fn, &scene, &region, clusterStart](int prim) {
+            if (prim < clusterStart) {
+                fn(scene.bvhStorageIndex(prim));
+                return;
+            }
+            const CompactSphereSet& set = scene.compactSpheres;
+            const CompactSphereSet::Cluster& cluster = set.clusters[prim - clusterStart];
+            for (unsigned int i = cluster.first; i < cluster.first + cluster.count; ++i) {
+                if (region.overlaps(set.decode(cluster, set.packed[i]).bounds())) fn((int)(scene.spheres.size() + i));
+            }
+        };
+        if (bvhMatchesScene()) {
+            bvh.forEachOverlapping(region, mapped);
+        } else {
+            for (int prim = 0; prim < (int)bvhPrimitiveCount(); ++prim) {
+                AABB bounds = prim < clusterStart ? primitiveBounds(bvhStorageIndex(prim))
+                                                  : CompactSphereSet::clusterBounds(compactSpheres.clusters[prim - clusterStart]);
+                if (region.overlaps(bounds)) mapped(prim);
+            }
+        }
+        if (!particles.empty()) {
+            int base = (int)(spheres.size() + compactSpheres.size());
+            auto shifted = [&fn, base](int i) { fn(base + i); };
+            particles.forEachOverlapping(region, shifted);
+        }
+    }
+    
+    // BVH primitive number -> storage index; a CSG shape maps to its first leaf
+    // and a compact cluster to its first sphere
+    int bvhStorageIndex(int prim) const {
+        int sphereEnd = (int)spheres.size(), quadricEnd = sphereEnd + (int)quadrics.size();
+        int shapeEnd = quadricEnd + (int)csgShapes.size();
+        if (prim < sphereEnd) return prim;
+        if (prim < quadricEnd) return sphereCount() + prim - sphereEnd;
+        if (prim < shapeEnd) return csgBase() + csgFirstLeaf[prim - quadricEnd];
+        return sphereEnd + (int)compactSpheres.clusters[prim - shapeEnd].first;
+    }
+    
+    // Material and shading normal at a hit point of any primitive
+    Material surfaceAt(int index, const Vec3& point, Vec3& normal) const {
+        return surfaceAt<PRIMS_ALL>(index, point, normal);
+    }
+    template <unsigned Prims>
+    Material surfaceAt(int index, const Vec3& point, Vec3& normal) const {
+        if ((Prims & PRIMS_CSG) && isCSG(index)) {
+            int shape = csgShapeOf(index);
+            int leaf = index - csgBase() - csgFirstLeaf[shape];
+            normal = csgShapes[shape].getNormal(leaf, point);
+            return csgShapes[shape].leaves[leaf].material;
+        }
+        if ((Prims & PRIMS_QUADRICS) && isQuadric(index)) {
+            const Quadric& quadric = getQuadric(index);
+            normal = quadric.getNormal(point);
+            return quadric.material;
+        }
+        Sphere sphere = getSphere<Prims>(index);
+        normal = sphere.getNormal(point);
+        return sphere.material;
+    }
+    
+    // Check if point is in shadow
+    bool isInShadow(const Vec3& point, const Vec3& lightPos) const {
+        return isInShadow<PRIMS_ALL | PRIMS_CHECKED>(point, lightPos);
+    }
+    template <unsigned Prims>
+    bool isInShadow(const Vec3& point, const Vec3& lightPos) const {
+        Vec3 toLight = lightPos - point;
+        double distToLight = toLight.length();
+        Ray shadowRay(point, toLight);
+        
+        double t;
+        int sphereIdx;
+        // Check if any object blocks the light
+        if (intersect<Prims>(shadowRay, t, sphereIdx, 0.001)) {
+            // If intersection is closer than light, we're in shadow
+            return t < distToLight;
+        }
+        
+        return false;
+    }
+    
+private:
+    size_t bvhTypeCounts[PRIM_TYPE_COUNT]; // Per PrimitiveType, at the last buildBVH
+    
+    // Boxes (and type tags) of the BVH's primitives, in BVH order
+    void collectBVHPrimitives(std::vector<AABB>& bounds, std::vector<unsigned char>* types) const {
+        bounds.clear();
+        bounds.reserve(bvhPrimitiveCount());
+        for (const Sphere& sphere : spheres) bounds.push_back(sphere.bounds());
+        for (const Quadric& quadric : quadrics) bounds.push_back(quadric.bounds());
+        for (const CSGShape& shape : csgShapes) bounds.push_back(shape.bounds());
+        for (const CompactSphereSet::Cluster& cluster : compactSpheres.clusters) {
+            bounds.push_back(CompactSphereSet::clusterBounds(cluster));
+        }
+        if (!types) return;
+        types->assign(spheres.size(), (unsigned char)PRIM_SPHERE);
+        types->insert(types->end(), quadrics.size(), (unsigned char)PRIM_QUADRIC);
+        types->insert(types->end(), csgShapes.size(), (unsigned char)PRIM_CSG);
+        types->insert(types->end(), compactSpheres.clusters.size(), (unsigned char)PRIM_CLUSTER);
+    }
+    
+    // Index sources for the leaf kernels: a BVH leaf's primitive list, or a plain range
+    struct Sequential {
+        int first;
+        explicit Sequential(int first) : first(first) {}
+        int operator[](int i) const { return first + i; }
+    };
+    
+    // BVH leaf intersector: switches on the leaf's primitive type once, then runs
+    // the loop for that type over the whole leaf. Primitive numbers follow the
+    // BVH's order (spheres, quadrics, CSG shapes, compact clusters); hitIndex is
+    // a storage index. Kinds outside Prims are compiled out, and a sphere-only
+    // mask skips the switch.
+    template <unsigned Prims>
+    struct LeafDispatch {
+        const Scene& scene;
+        const Ray& ray;
+        double tMin;
+        int hitIndex;
+        
+        LeafDispatch(const Scene& scene, const Ray& ray, double tMin)
+            : scene(scene), ray(ray), tMin(tMin), hitIndex(-1) {}
+        
+        bool operator()(int type, const int* prims, int count, double& tMax) {
+            if (!(Prims & (PRIMS_QUADRICS | PRIMS_CSG | PRIMS_CLUSTERS))) return testSpheres(prims, count, tMax);
+            switch (type) {
+            case PRIM_SPHERE:  return testSpheres(prims, count, tMax);
+            case PRIM_QUADRIC: return (Prims & PRIMS_QUADRICS) && testQuadrics(prims, count, tMax);
+            case PRIM_CSG:     return (Prims & PRIMS_CSG) && testShapes(prims, count, tMax);
+            case PRIM_CLUSTER: return (Prims & PRIMS_CLUSTERS) && testClusters(prims, count, tMax);
+            }
+            return false;
+        }
+        
+        template <class Indices>
+        bool testSpheres(Indices prims, int count, double& tMax) {
+            bool hit = false;
+            for (int i = 0; i < count; ++i) {
+                double t;
+                if (scene.spheres[prims[i]].intersect(ray, t, tMin, tMax)) {
+                    tMax = t;
+                    hitIndex = prims[i];
+                    hit = true;
+                }
+            }
+            return hit;
+        }
+        
+        template <class Indices>
+        bool testQuadrics(Indices prims, int count, double& tMax) {
+            int base = (int)scene.spheres.size();
+            bool hit = false;
+            for (int i = 0; i < count; ++i) {
+                double t;
+                if (scene.quadrics[prims[i] - base].intersect(ray, t, tMin, tMax)) {
+                    tMax = t;
+                    hitIndex = scene.sphereCount() + prims[i] - base;
+                    hit = true;
+                }
+            }
+            return hit;
+        }
+        
+        template <class Indices>
+        bool testShapes(Indices prims, int count, double& tMax) {
+            int base = (int)(scene.spheres.size() + scene.quadrics.size());
+            bool hit = false;
+            for (int i = 0; i < count; ++i) {
+                int shape = prims[i] - base;
+                double t;
+                int leaf;
+                if (scene.csgShapes[shape].intersect(ray, t, leaf, tMin, tMax)) {
+                    tMax = t;
+                    hitIndex = scene.csgBase() + scene.csgFirstLeaf[shape] + leaf;
+                    hit = true;
+                }
+            }
+            return hit;
+        }
+        
+        template <class Indices>
+        bool testClusters(Indices prims, int count, double& tMax) {
+            if (count == 0) return false;
+            int base = (int)(scene.spheres.size() + scene.quadrics.size() + scene.csgShapes.size());
+            Vec3 invDir = AABB::inverseDirection(ray);
+            bool hit = false;
+            for (int i = 0; i < count; ++i) {
+                double t;
+                int index;
+                if (scene.compactSpheres.intersectCluster(prims[i] - base, ray, invDir, t, index, tMin, tMax)) {
+                    tMax = t;
+                    hitIndex = (int)scene.spheres.size() + index;
+                    hit = true;
+                }
+            }
+            return hit;
+        }
+    };
+};
+
+// ============
+// Camera Class
+// ============
+class Camera {
+public:
+    Vec3 position;
+    Vec3 lookAt;
+    Vec3 up;
+    double fov; // Field of view in degrees
+    
+    Camera(const Vec3& position, const Vec3& lookAt, const Vec3& up, double fov)
+        : position(position), lookAt(lookAt), up(up), fov(fov) {}
+    
+    // Follow a Scene::rebase
+    void translate(const Vec3& offset) {
+        position = position + offset;
+        lookAt = lookAt + offset;
+    }
+    
+    Ray getRay(double u, double v, int width, int height) const {
+        // Calculate camera basis vectors
+        Vec3 forward = (lookAt - position).normalize();
+        Vec3 right = forward.cross(up).normalize();
+        Vec3 upVec = right.cross(forward);
+        
+        double aspectRatio = (double)width / height;
+        double scale = std::tan(fov * 0.5 * M_PI / 180.0);
+        
+        // Map pixel coordinates to [-1, 1] range
+        double x = (2.0 * u / width - 1.0) * aspectRatio * scale;
+        double y = (1.0 - 2.0 * v / height) * scale;
+        
+        Vec3 direction = (forward + right * x + upVec * y).normalize();
+        return Ray(position, direction);
+    }
+    
+    // The six 90-degree cube map faces around a point, ordered +X, -X, +Y, -Y, +Z, -Z.
+    // Side faces keep +Y up; +Y uses +Z and -Y uses -Z as up, so in a horizontal
+    // cross with -Z as the front face every face edge meets its neighbour.
+    // Render each face into a square image.
+    static std::vector<Camera> cubemapFaces(const Vec3& position) {
+        const Vec3 forward[6] = { Vec3(1, 0, 0), Vec3(-1, 0, 0), Vec3(0, 1, 0),
+                                  Vec3(0, -1, 0), Vec3(0, 0, 1), Vec3(0, 0, -1) };
+        const Vec3 up[6] = { Vec3(0, 1, 0), Vec3(0, 1, 0), Vec3(0, 0, 1),
+                             Vec3(0, 0, -1), Vec3(0, 1, 0), Vec3(0, 1, 0) };
+        std::vector<Camera> faces;
+        for (int i = 0; i < 6; ++i) {
+            faces.push_back(Camera(position, position + forward[i], up[i], 90));
+        }
+        return faces;
+    }
+};
+
+// ============================
+// Equirectangular Camera Class
+// ============================
+// Full 360 x 180 degree panorama: columns map to longitude and rows to latitude,
+// with the look-at direction in the image center
+class EquirectangularCamera {
+public:
+    Vec3 position;
+    Vec3 lookAt;
+    Vec3 up;
+    
+    EquirectangularCamera(const Vec3& position, const Vec3& lookAt, const Vec3& up)
+        : position(position), lookAt(lookAt), up(up) {}
+    
+    // Follow a Scene::rebase
+    void translate(const Vec3& offset) {
+        position = position + offset;
+        lookAt = lookAt + offset;
+    }
+    
+    Ray getRay(double u, double v, int width, int height) const {
+        Vec3 forward = (lookAt - position).normalize();
+        Vec3 right = forward.cross(up).normalize();
+        Vec3 upVec = right.cross(forward);
+        
+        double longitude = (2.0 * u / width - 1.0) * M_PI;
+        double latitude = (0.5 - v / height) * M_PI;
+        Vec3 direction = forward * (std::cos(latitude) * std::cos(longitude)) +
+                         right * (std::cos(latitude) * std::sin(longitude)) +
+                         upVec * std::sin(latitude);
+        return Ray(position, direction);
+    }
+};
+
+// ===========
+// Image Class
+// ===========
+class Image {
+public:
+    int width, height;
+    std::vector<Vec3> pixels;
+    
+    Image(int width, int height) : width(width), height(height) {
+        pixels.resize(width * height);
+    }
+    
+    void setPixel(int x, int y, const Vec3& color) {
+        if (x >= 0 && x < width && y >= 0 && y < height) {
+            pixels[y * width + x] = color;
+        }
+    }
+    
+    Vec3 getPixel(int x, int y) const {
         if (x >= 0 && x < width && y >= 0 && y < height) {
             return pixels[y * width + x];
         }
-        return Vec3(0, 0, 0);
-    }
+        return Vec3(0, 0, 0);
+    }
+    
+    // Bilinear lookup at continuous pixel coordinates, clamped to the border
+    Vec3 sample(double fx, double fy) const {
+        fx = std::min(std::max(fx, 0.0), width - 1.0);
+        fy = std::min(std::max(fy, 0.0), height - 1.0);
+        int x0 = std::min((int)fx, width - 2 > 0 ? width - 2 : 0);
+        int y0 = std::min((int)fy, height - 2 > 0 ? height - 2 : 0);
+        int x1 = std::min(x0 + 1, width - 1);
+        int y1 = std::min(y0 + 1, height - 1);
+        double wx = fx - x0, wy = fy - y0;
+        Vec3 top = getPixel(x0, y0) * (1.0 - wx) + getPixel(x1, y0) * wx;
+        Vec3 bottom = getPixel(x0, y1) * (1.0 - wx) + getPixel(x1, y1) * wx;
+        return top * (1.0 - wy) + bottom * wy;
+    }
+    
+    // Color at pixel (x, y) of a width x height image covering the same view
+    Vec3 sampleScaled(int x, int y, int targetWidth, int targetHeight) const {
+        return sample((x + 0.5) * width / targetWidth - 0.5, (y + 0.5) * height / targetHeight - 0.5);
+    }
+    
+    // Save as PPM format (simple, no library needed)
+    void savePPM(const std::string& filename) const {
+        std::ofstream file(filename);
+        file << "P3\n" << width << " " << height << "\n255\n";
+        
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                Vec3 color = getPixel(x, y);
+                // Clamp values to [0, 1] and convert to [0, 255]
+                int r = std::min(255, std::max(0, (int)(color.x() * 255)));
+                int g = std::min(255, std::max(0, (int)(color.y() * 255)));
+                int b = std::min(255, std::max(0, (int)(color.z() * 255)));
+                file << r << " " << g << " " << b << " ";
+            }
+            file << "\n";
+        }
+        
+        file.close();
+    }
+};
+
+// ==================
+// Mapped Image Class
+// ==================
+// An output file created at its final size and memory-mapped, so setPixel
+// quantises straight into the file and no framebuffer is held. The renderer
+// takes it in place of an Image; tiles write disjoint bytes, so they can be
+// rendered concurrently. close() flushes with msync.
+class MappedImage {
+public:
+    enum Format {
+        MAPPED_P6,   // binary PPM, 8 bits per channel, same quantisation as savePPM
+        MAPPED_FLOAT // PFM: unclamped 32-bit floats, rows stored bottom-up
+    };
+    
+    int width, height;
+    
+    MappedImage() : width(0), height(0), format(MAPPED_P6), fd(-1), data(0), size(0), headerSize(0) {}
+    ~MappedImage() { std::string error; close(error); }
+    
+    // Create (or truncate) the file at its final size and map it
+    bool open(const std::string& filename, int w, int h, Format f, std::string& error) {
+        std::string ignored;
+        close(ignored);
+        std::ostringstream header;
+        header << (f == MAPPED_FLOAT ? "PF" : "P6") << "\n" << w << " " << h << "\n"
+               << (f == MAPPED_FLOAT ? "-1.0" : "255") << "\n";
+        std::string text = header.str();
+        headerSize = text.size();
+        size = headerSize + (size_t)w * (size_t)h * (f == MAPPED_FLOAT ? 3 * sizeof(float) : 3);
+#ifndef _WIN32
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = "Could not create " + filename;
+            return false;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+            error = "Could not size " + filename;
+            close(ignored);
+            return false;
+        }
+        void* mapped = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            error = "Could not map " + filename;
+            close(ignored);
+            return false;
+        }
+        data = (unsigned char*)mapped;
+        std::memcpy(data, text.data(), headerSize);
+        width = w;
+        height = h;
+        format = f;
+        return true;
+#else
+        error = "Memory-mapped output needs POSIX mmap";
+        return false;
+#endif
+    }
+    
+    void setPixel(int x, int y, const Vec3& color) {
+        if (x < 0 || x >= width || y < 0 || y >= height) return;
+        if (format == MAPPED_FLOAT) {
+            float rgb[3] = {(float)color.x(), (float)color.y(), (float)color.z()};
+            size_t offset = headerSize + ((size_t)(height - 1 - y) * width + x) * sizeof(rgb);
+            std::memcpy(data + offset, rgb, sizeof(rgb));
+        } else {
+            unsigned char* p = data + headerSize + ((size_t)y * width + x) * 3;
+            p[0] = (unsigned char)std::min(255, std::max(0, (int)(color.x() * 255)));
+            p[1] = (unsigned char)std::min(255, std::max(0, (int)(color.y() * 255)));
+            p[2] = (unsigned char)std::min(255, std::max(0, (int)(color.z() * 255)));
+        }
+    }
+    
+    // Flush the mapping to disk and release it; false if the flush failed
+    bool close(std::string& error) {
+        bool ok = true;
+#ifndef _WIN32
+        if (data) {
+            if (msync(data, size, MS_SYNC) != 0) {
+                error = "Could not flush the mapped image";
+                ok = false;
+            }
+            munmap(data, size);
+        }
+        if (fd >= 0) ::close(fd);
+#endif
+        data = 0;
+        fd = -1;
+        width = height = 0;
+        return ok;
+    }
+    
+    bool isOpen() const { return data != 0; }
+    
+private:
+    Format format;
+    int fd;
+    unsigned char* data;
+    size_t size, headerSize;
+    
+    MappedImage(const MappedImage&);
+    MappedImage& operator=(const MappedImage&);
+};
+
+// =================
+// Thread Pool Class
+// =================
+// Fixed set of worker threads draining one shared task queue
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount = 0) : activeTasks(0), stopping(false) {
+        if (threadCount <= 0) threadCount = defaultThreadCount();
+        for (int i = 0; i < threadCount; ++i) {
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+        }
+    }
+    
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+    
+    void submit(const std::function<void()>& task) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            tasks.push_back(task);
+        }
+        taskAvailable.notify_one();
+    }
+    
+    // Block until every submitted task has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        allDone.wait(lock, [this] { return tasks.empty() && activeTasks == 0; });
+    }
+    
+    int size() const { return (int)workers.size(); }
+    
+    static int defaultThreadCount() {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n > 0 ? (int)n : 1;
+    }
+    
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allDone;
+    int activeTasks;
+    bool stopping;
+    
+    void workerLoop() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = tasks.front();
+                tasks.pop_front();
+                ++activeTasks;
+            }
+            task();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                --activeTasks;
+                if (tasks.empty() && activeTasks == 0) allDone.notify_all();
+            }
+        }
+    }
+};
+
+// ================
+// Light Bake Class
+// ================
+// Precomputed direct lighting for static scenes. Each sphere gets a small
+// latitude/longitude chart of irradiance (light color x intensity x N.L x
+// shadow visibility, before the material color) sampled at points on its
+// surface. Rendering with RenderOptions::baked() then shades by a bilinear
+// lookup instead of firing shadow rays, so a fly-through costs little more
+// than primary visibility. Chart resolution follows sphere size; shadow edges
+// are blurred over about one texel, and very large spheres (a ground sphere)
+// hit maxRows first, so raise it if their shadows look blocky. Re-bake after
+// moving spheres or lights.
+class LightBake {
+public:
+    struct Chart {
+        size_t offset; // First texel in `irradiance`
+        int rows, cols; // Latitude x longitude texels
+    };
+    
+    std::vector<Chart> charts;     // Per sphere ID, so a bake survives Scene::reorderSpheres()
+    std::vector<float> irradiance; // RGB per texel
+    
+    // Texels per pool task: runs of small charts share a task, large charts are
+    // split into blocks of rows
+    static const size_t TEXELS_PER_TASK = 16384;
+    
+    // texelSize is the target texel edge in world units, clamped per sphere to
+    // [minRows, maxRows] latitude rows (with twice as many longitude columns).
+    // Only Scene::spheres are baked; compact spheres and particles are lit
+    // directly, so their count costs neither memory nor tasks here.
+    void bake(const Scene& scene, double texelSize = 0.05, int minRows = 4, int maxRows = 512, int threadCount = 0) {
+        int count = (int)scene.spheres.size();
+        charts.resize(count);
+        size_t texels = 0;
+        for (int i = 0; i < count; ++i) {
+            double radius = scene.getSphere(scene.sphereIndex(i)).radius;
+            int rows = (int)std::min((double)maxRows, std::max((double)minRows, std::ceil(M_PI * radius / texelSize)));
+            charts[i].offset = texels;
+            charts[i].rows = rows;
+            charts[i].cols = 2 * rows;
+            texels += (size_t)rows * charts[i].cols;
+        }
+        irradiance.assign(texels * 3, 0.0f);
+        
+        ThreadPool pool(threadCount);
+        int first = 0;
+        size_t pending = 0;
+        for (int i = 0; i < count; ++i) {
+            size_t chartTexels = (size_t)charts[i].rows * charts[i].cols;
+            if (chartTexels < TEXELS_PER_TASK) {
+                pending += chartTexels;
+                if (pending < TEXELS_PER_TASK) continue;
+                pool.submit([this, &scene, first, i] { bakeCharts(scene, first, i + 1); });
+            } else {
+                if (first < i) pool.submit([this, &scene, first, i] { bakeCharts(scene, first, i); });
+                int blockRows = std::max(1, (int)(TEXELS_PER_TASK / charts[i].cols));
+                for (int row = 0; row < charts[i].rows; row += blockRows) {
+                    int end = std::min(row + blockRows, charts[i].rows);
+                    pool.submit([this, &scene, i, row, end] { bakeRows(scene, i, row, end); });
+                }
+            }
+            first = i + 1;
+            pending = 0;
+        }
+        if (first < count) pool.submit([this, &scene, first, count] { bakeCharts(scene, first, count); });
+        pool.wait();
+    }
+    
+    // Whether lookup() has a chart for the sphere at a storage index
+    bool covers(const Scene& scene, int sphereIndex) const {
+        return sphereIndex < (int)scene.spheres.size() && scene.sphereId(sphereIndex) < (int)charts.size();
+    }
+    
+    // Bilinearly filtered irradiance for a unit normal on a sphere, by sphere ID
+    Vec3 lookup(int sphereId, const Vec3& normal) const {
+        const Chart& chart = charts[sphereId];
+        double theta = std::acos(std::min(1.0, std::max(-1.0, normal.y())));
+        double phi = std::atan2(normal.z(), normal.x());
+        
+        double fy = theta / M_PI * chart.rows - 0.5;
+        double fx = (phi + M_PI) / (2.0 * M_PI) * chart.cols - 0.5;
+        int y0 = (int)std::floor(fy);
+        int x0 = (int)std::floor(fx);
+        double wy = fy - y0;
+        double wx = fx - x0;
+        
+        Vec3 top = texel(chart, y0, x0) * (1.0 - wx) + texel(chart, y0, x0 + 1) * wx;
+        Vec3 bottom = texel(chart, y0 + 1, x0) * (1.0 - wx) + texel(chart, y0 + 1, x0 + 1) * wx;
+        return top * (1.0 - wy) + bottom * wy;
+    }
+    
+    size_t memoryBytes() const { return charts.size() * sizeof(Chart) + irradiance.size() * sizeof(float); }
+    
+private:
+    // Rows clamp at the poles, columns wrap around
+    Vec3 texel(const Chart& chart, int row, int col) const {
+        row = std::min(std::max(row, 0), chart.rows - 1);
+        col = ((col % chart.cols) + chart.cols) % chart.cols;
+        const float* t = &irradiance[(chart.offset + (size_t)row * chart.cols + col) * 3];
+        return Vec3(t[0], t[1], t[2]);
+    }
+    
+    void bakeCharts(const Scene& scene, int first, int last) {
+        for (int i = first; i < last; ++i) bakeRows(scene, i, 0, charts[i].rows);
+    }
+    
+    void bakeRows(const Scene& scene, int sphereId, int rowBegin, int rowEnd) {
+        for (int row = rowBegin; row < rowEnd; ++row) bakeRow(scene, sphereId, row);
+    }
+    
+    void bakeRow(const Scene& scene, int sphereId, int row) {
+        const Chart& chart = charts[sphereId];
+        Sphere sphere = scene.getSphere(scene.sphereIndex(sphereId));
+        double theta = (row + 0.5) / chart.rows * M_PI;
+        for (int col = 0; col < chart.cols; ++col) {
+            double phi = (col + 0.5) / chart.cols * 2.0 * M_PI - M_PI;
+            Vec3 normal(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            Vec3 point = sphere.center + normal * sphere.radius;
+            
+            Vec3 sum(0, 0, 0);
+            for (const Light& light : scene.lights) {
+                Vec3 toLight = (light.position - point).normalize();
+                double diffuse = normal.dot(toLight);
+                if (diffuse > 0 && !scene.isInShadow(point, light.position)) {
+                    sum = sum + light.color * (diffuse * light.intensity);
+                }
+            }
+            float* t = &irradiance[(chart.offset + (size_t)row * chart.cols + col) * 3];
+            t[0] = (float)sum.x();
+            t[1] = (float)sum.y();
+            t[2] = (float)sum.z();
+        }
+    }
+};
+
+// ============================
+// Light Visibility Cache Class
+// ============================
+// World-space grid that remembers, per (cell, light, shaded sphere), whether
+// every point of that sphere inside the cell is fully lit, fully occluded or
+// mixed. Only mixed cells fire shadow rays. Cells are classified lazily by a
+// conservative test of the other spheres against the cone from the light to the
+// cell, so cached answers match what a shadow ray would return. (The shaded
+// sphere itself is skipped: a sphere can only shadow its own points where
+// N.L <= 0, and those receive no diffuse light anyway.)
+//
+// The table is a fixed-size open-addressing hash shared by all threads without
+// locks: a slot is claimed with a CAS and its state is published last with a
+// release store. Two threads may classify the same cell at once; the duplicate
+// entry is harmless. Entries are keyed by the light's position as well as its
+// index, so a moved light (Relighter::setLight) misses and is reclassified
+// instead of getting the old answer; its stale entries only take up slots.
+// Keep the cache across frames while geometry stays put, and clear() it (with
+// no render running) after moving geometry, or to reclaim slots after many
+// light moves.
+class LightVisibilityCache {
+public:
+    enum Visibility {
+        VIS_EMPTY,
+        VIS_WRITING,
+        VIS_LIT,
+        VIS_OCCLUDED,
+        VIS_MIXED
+    };
+    
+    explicit LightVisibilityCache(double cellSize = 0.25, int capacityLog2 = 20)
+        : cellSize(cellSize), mask(((size_t)1 << capacityLog2) - 1), entries((size_t)1 << capacityLog2) {}
+    
+    // Same answer as scene.isInShadow(point, light.position) wherever N.L > 0
+    bool isInShadow(const Scene& scene, const Vec3& point, int sphereIndex, int lightIndex) const {
+        const Vec3& lightPos = scene.lights[lightIndex].position;
+        int visibility = lookup(scene, point, sphereIndex, lightIndex);
+        if (visibility == VIS_LIT) return false;
+        if (visibility == VIS_OCCLUDED) return true;
+        return scene.isInShadow(point, lightPos);
+    }
+    
+    void clear() {
+        for (Entry& entry : entries) entry.state.store(VIS_EMPTY, std::memory_order_relaxed);
+    }
+    
+    double getCellSize() const { return cellSize; }
+    
+private:
+    struct Entry {
+        std::atomic<unsigned long long> cell;
+        std::atomic<unsigned long long> owner; // (light << 32) | shaded sphere's ID
+        std::atomic<unsigned long long> lightKey; // Hash of the light position's bits
+        std::atomic<int> state;
+        
+        Entry() : cell(0), owner(0), lightKey(0), state(VIS_EMPTY) {}
+    };
+    
+    static const int MAX_PROBES = 32; // Past this, answer "mixed" and just trace
+    
+    double cellSize;
+    size_t mask;
+    mutable std::vector<Entry> entries;
+    
+    LightVisibilityCache(const LightVisibilityCache&);
+    LightVisibilityCache& operator=(const LightVisibilityCache&);
+    
+    int lookup(const Scene& scene, const Vec3& point, int sphereIndex, int lightIndex) const {
+        long long ix = (long long)std::floor(point.x() / cellSize);
+        long long iy = (long long)std::floor(point.y() / cellSize);
+        long long iz = (long long)std::floor(point.z() / cellSize);
+        // 21 bits per axis; the top bit keeps packed keys nonzero
+        const long long bias = 1 << 20;
+        if (std::abs(ix) >= bias || std::abs(iy) >= bias || std::abs(iz) >= bias) return VIS_MIXED;
+        unsigned long long cell = (1ULL << 63) | ((unsigned long long)(ix + bias) << 42) |
+                                  ((unsigned long long)(iy + bias) << 21) | (unsigned long long)(iz + bias);
+        // The sphere ID rather than its storage index, so reorderSpheres() leaves entries valid
+        unsigned long long owner = ((unsigned long long)lightIndex << 32) | (unsigned int)scene.sphereId(sphereIndex);
+        const Vec3& lightPos = scene.lights[lightIndex].position;
+        unsigned long long light = positionKey(lightPos);
+        
+        size_t slot = (size_t)((cell ^ ((owner ^ light) * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL >> 20) & mask;
+        for (int probe = 0; probe < MAX_PROBES; ++probe, slot = (slot + 1) & mask) {
+            Entry& entry = entries[slot];
+            int state = entry.state.load(std::memory_order_acquire);
+            if (state == VIS_EMPTY) {
+                Vec3 center((ix + 0.5) * cellSize, (iy + 0.5) * cellSize, (iz + 0.5) * cellSize);
+                int visibility = classify(scene, center, sphereIndex, lightPos);
+                int expected = VIS_EMPTY;
+                if (entry.state.compare_exchange_strong(expected, VIS_WRITING, std::memory_order_acquire)) {
+                    entry.cell.store(cell, std::memory_order_relaxed);
+                    entry.owner.store(owner, std::memory_order_relaxed);
+                    entry.lightKey.store(light, std::memory_order_relaxed);
+                    entry.state.store(visibility, std::memory_order_release);
+                }
+                return visibility;
+            }
+            if (state != VIS_WRITING && entry.cell.load(std::memory_order_relaxed) == cell &&
+                entry.owner.load(std::memory_order_relaxed) == owner &&
+                entry.lightKey.load(std::memory_order_relaxed) == light) {
+                return state;
+            }
+        }
+        return VIS_MIXED;
+    }
+    
+    // 64-bit mix of the coordinates' bit patterns; any move changes it
+    static unsigned long long positionKey(const Vec3& p) {
+        double coords[3] = { p.x(), p.y(), p.z() };
+        unsigned long long key = 0;
+        for (double c : coords) {
+            unsigned long long bits;
+            std::memcpy(&bits, &c, sizeof(bits));
+            key = (key ^ bits) * 0x9E3779B97F4A7C15ULL;
+            key ^= key >> 29;
+        }
+        return key;
+    }
+    
+    // Conservative classification of the cell's bounding ball against every
+    // primitive near the segment light -> cell center. The BVH query prunes by
+    // distance to that segment rather than by the box around it, so a light far
+    // from the cell no longer pulls in everything between them.
+    int classify(const Scene& scene, const Vec3& cellCenter, int sphereIndex, const Vec3& lightPos) const {
+        OccluderTest test(scene, cellCenter, cellSize * 0.8660254037844386, lightPos, sphereIndex);
+        if (!(test.cellDistance > test.cellRadius)) return VIS_MIXED; // Light inside the cell's ball
+        ShadowCapsule region(lightPos, test.axis, test.cellDistance, test.cellRadius + test.margin);
+        scene.forEachSphereOverlapping(region, test);
+        if (test.occluded) return VIS_OCCLUDED;
+        return test.mixed ? VIS_MIXED : VIS_LIT;
+    }
+    
+    // Distance from a point to the segment from + axis * [0, length]
+    static double segmentDistance(const Vec3& from, const Vec3& axis, double length, const Vec3& point) {
+        Vec3 toPoint = point - from;
+        double along = std::min(std::max(toPoint.dot(axis), 0.0), length);
+        return (toPoint - axis * along).length();
+    }
+    
+    // Points within radius of the shadow segment. Boxes are tested through their
+    // bounding ball, which keeps the test conservative and cheap
+    struct ShadowCapsule {
+        Vec3 from, axis;
+        double length, radius;
+        AABB bounds;
+        
+        ShadowCapsule(const Vec3& from, const Vec3& axis, double length, double radius)
+            : from(from), axis(axis), length(length), radius(radius) {
+            Vec3 r(radius, radius, radius);
+            bounds = AABB(from - r, from + r);
+            bounds.expand(AABB(from + axis * length - r, from + axis * length + r));
+        }
+        
+        bool overlaps(const AABB& box) const {
+            if (!bounds.overlaps(box)) return false;
+            // Written so an unbounded box (NaN center) is kept
+            return !(segmentDistance(from, axis, length, box.center()) > box.extent().length() * 0.5 + radius);
+        }
+        
+        ShadowCapsule translated(const Vec3& offset) const {
+            ShadowCapsule moved(*this);
+            moved.from = from + offset;
+            moved.bounds = bounds.translated(offset);
+            return moved;
+        }
+    };
+    
+    struct OccluderTest {
+        const Scene& scene;
+        Vec3 cellCenter, lightPos, axis;
+        double cellRadius, cellDistance, margin;
+        int sphereIndex;
+        bool mixed, occluded;
+        
+        OccluderTest(const Scene& scene, const Vec3& cellCenter, double cellRadius, const Vec3& lightPos, int sphereIndex)
+            : scene(scene), cellCenter(cellCenter), lightPos(lightPos), cellRadius(cellRadius),
+              sphereIndex(sphereIndex), mixed(false), occluded(false) {
+            axis = cellCenter - lightPos;
+            cellDistance = axis.length();
+            axis = axis.normalize();
+            margin = 1e-9 * (1.0 + cellDistance);
+        }
+        
+        void operator()(int index) {
+            // CSG shapes can be concave, so they may shadow themselves
+            if ((index == sphereIndex && !scene.isCSG(index)) || occluded) return;
+            if (!scene.isSphere(index)) {
+                // Quadrics and CSG shapes only get the reject test, against the ball around their box
+                AABB box = scene.primitiveBounds(index);
+                if (segmentDistance(box.center()) <= box.extent().length() * 0.5 + cellRadius + margin) mixed = true;
+                return;
+            }
+            Sphere sphere = scene.getSphere(index);
+            
+            // Every shadow segment lies within cellRadius of the segment light -> cell center
+            Vec3 toSphere = sphere.center - lightPos;
+            if (segmentDistance(sphere.center) > sphere.radius + cellRadius + margin) return;
+            
+            // Fully occluding: the cell's cone from the light fits inside the
+            // sphere's cone, and the whole sphere lies between light and cell
+            double sphereDistance = toSphere.length();
+            if (sphereDistance > sphere.radius && cellDistance > cellRadius &&
+                cellDistance - cellRadius > sphereDistance + sphere.radius + 0.001 + margin) {
+                double angle = std::acos(std::min(1.0, std::max(-1.0, toSphere.dot(axis) / sphereDistance)));
+                double cellAngle = std::asin(cellRadius / cellDistance);
+                double sphereAngle = std::asin(sphere.radius / sphereDistance);
+                if (angle + cellAngle < sphereAngle - 1e-9) {
+                    occluded = true;
+                    return;
+                }
+            }
+            mixed = true;
+        }
+        
+        // Distance from a point to the segment light -> cell center
+        double segmentDistance(const Vec3& point) const {
+            return LightVisibilityCache::segmentDistance(lightPos, axis, cellDistance, point);
+        }
+    };
+};
+
+// ==============
+// Renderer Class
+// ==============
+
+// What a render kernel writes into each pixel
+enum RenderOutput {
+    OUTPUT_DISTANCE, // Step b: distance to closest sphere as grayscale
+    OUTPUT_MATERIAL, // Step c: flat material color
+    OUTPUT_SHADED,   // Steps d/e: ambient + diffuse lighting
+    OUTPUT_BAKED     // Ambient + diffuse lighting looked up from a LightBake
+};
+
+// How a kernel decides whether a light reaches a surface point
+enum ShadowMode {
+    SHADOWS_NONE,   // Every light is visible
+    SHADOWS_TRACED, // One shadow ray per light
+    SHADOWS_CACHED  // LightVisibilityCache, tracing only in partially shadowed cells
+};
+
+// Number of lights, classified so the kernel can drop or unroll the light loop
+enum LightClass {
+    LIGHTS_NONE,
+    LIGHTS_ONE,
+    LIGHTS_MANY
+};
+
+// Runtime render settings; Renderer::render maps them onto a kernel instantiation
+struct RenderOptions {
+    RenderOutput output;
+    bool shadows;
+    const LightBake* bake;                         // Required for OUTPUT_BAKED
+    const LightVisibilityCache* visibilityCache;   // Optional; answers shadow queries where it can
+    int samplesPerAxis;                            // Stratified n x n samples per pixel
+    int checkerboardParity;                        // 0 or 1: only pixels with (x + y) % 2 == parity; -1: all
+    int* sphereIdBuffer;                           // Optional width * height output: hit sphere index or -1
+
+    RenderOptions(RenderOutput output = OUTPUT_SHADED, bool shadows = true)
+        : output(output), shadows(shadows), bake(0), visibilityCache(0), samplesPerAxis(1),
+          checkerboardParity(-1), sphereIdBuffer(0) {}
+    
+    static RenderOptions baked(const LightBake& bake) {
+        RenderOptions options(OUTPUT_BAKED, false);
+        options.bake = &bake;
+        return options;
+    }
+};
+
+// Pixel rectangle [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+    
+    Tile(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {}
+    
+    // Split an image into tiles of at most tileSize x tileSize pixels
+    static std::vector<Tile> split(int width, int height, int tileSize) {
+        std::vector<Tile> tiles;
+        for (int y = 0; y < height; y += tileSize) {
+            for (int x = 0; x < width; x += tileSize) {
+                tiles.push_back(Tile(x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)));
+            }
+        }
+        return tiles;
+    }
+};
+
+class Renderer {
+public:
+    // Render with the kernel variant matching the options and the scene.
+    // CameraT is any type with Camera's getRay(u, v, width, height); ImageT is
+    // any type with Image's width, height and setPixel(x, y, color).
+    template <class CameraT, class ImageT>
+    static void render(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options) {
+        renderTile(img, camera, scene, options, Tile(0, 0, img.width, img.height));
+    }
+    
+    // Render one tile of the image; tiles can be rendered concurrently
+    template <class CameraT, class ImageT>
+    static void renderTile(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options,
+                           const Tile& tile) {
+        if (options.sphereIdBuffer) {
+            renderPrimitives<true>(img, camera, scene, options, tile);
+        } else {
+            renderPrimitives<false>(img, camera, scene, options, tile);
+        }
+    }
+    
+    // Step b: Render distance to closest sphere
+    static void renderDistance(Image& img, const Camera& camera, const Scene& scene) {
+        render(img, camera, scene, RenderOptions(OUTPUT_DISTANCE, false));
+    }
+    
+    // Step c: Render with material colors
+    static void renderMaterials(Image& img, const Camera& camera, const Scene& scene) {
+        render(img, camera, scene, RenderOptions(OUTPUT_MATERIAL, false));
+    }
+    
+    // Step d: Render with basic diffuse shading (N · L)
+    static void renderDiffuse(Image& img, const Camera& camera, const Scene& scene) {
+        render(img, camera, scene, RenderOptions(OUTPUT_SHADED, false));
+    }
+    
+    // Step e: Render with shadows
+    static void renderWithShadows(Image& img, const Camera& camera, const Scene& scene) {
+        render(img, camera, scene, RenderOptions(OUTPUT_SHADED, true));
+    }
+    
+    static Vec3 background() { return Vec3(0.5, 0.7, 1.0); } // Sky blue
+    
+    // Diffuse contribution of one light at a surface point
+    template <ShadowMode Shadows, unsigned Prims = Scene::PRIMS_ALL | Scene::PRIMS_CHECKED>
+    static Vec3 directLight(const Scene& scene, const RenderOptions& options, int lightIndex, const Vec3& hitPoint,
+                            const Vec3& normal, const Vec3& materialColor, int sphereIndex) {
+        const Light& light = scene.lights[lightIndex];
+        if (Shadows == SHADOWS_TRACED && scene.isInShadow<Prims>(hitPoint, light.position)) {
+            return Vec3(0, 0, 0);
+        }
+        if (Shadows == SHADOWS_CACHED &&
+            options.visibilityCache->isInShadow(scene, hitPoint, sphereIndex, lightIndex)) {
+            return Vec3(0, 0, 0);
+        }
+        Vec3 toLight = (light.position - hitPoint).normalize();
+        double diffuse = std::max(0.0, normal.dot(toLight));
+        return materialColor * light.color * (diffuse * light.intensity);
+    }
+    
+    // Color seen along one primary ray; every branch on a template parameter folds away
+    // WriteIds stores the sphere hit (or -1) in *hitSphere; Prims is a
+    // Scene::PrimitiveKinds mask covering the scene
+    template <RenderOutput Output, ShadowMode Shadows, LightClass Lights, bool WriteIds, unsigned Prims>
+    static Vec3 tracePrimary(const Ray& ray, const Scene& scene, const RenderOptions& options, int* hitSphere) {
+        double t;
+        int sphereIdx;
+        bool hit = scene.intersect<Prims>(ray, t, sphereIdx);
+        if (WriteIds) *hitSphere = hit ? sphereIdx : -1;
+        if (!hit) {
+            return background();
+        }
+        
+        if (Output == OUTPUT_DISTANCE) {
+            // Encode distance as color (normalize to reasonable range)
+            double normalizedDist = 1.0 - std::min(1.0, t / 20.0);
+            return Vec3(normalizedDist, normalizedDist, normalizedDist);
+        }
+        
+        Vec3 hitPoint = ray.at(t);
+        Vec3 normal;
+        Material material = scene.surfaceAt<Prims>(sphereIdx, hitPoint, normal);
+        Vec3 materialColor = scene.materialColor(material, hitPoint, normal);
+        return shadeHit<Output, Shadows, Lights, Prims>(scene, options, hitPoint, normal, materialColor, sphereIdx);
+    }
+    
+    // Everything after the surface color is known
+    template <RenderOutput Output, ShadowMode Shadows, LightClass Lights, unsigned Prims>
+    static Vec3 shadeHit(const Scene& scene, const RenderOptions& options, const Vec3& hitPoint, const Vec3& normal,
+                         const Vec3& materialColor, int sphereIdx) {
+        if (Output == OUTPUT_MATERIAL) {
+            return materialColor;
+        }
+        
+        // Start with ambient light
+        Vec3 finalColor = scene.ambientLight * materialColor;
+        
+        if (Output == OUTPUT_BAKED) {
+            if (options.bake->covers(scene, sphereIdx)) {
+                return finalColor + materialColor * options.bake->lookup(scene.sphereId(sphereIdx), normal);
+            }
+            // Bakes cover regular spheres only; compact spheres, particles,
+            // quadrics and CSG shapes are lit directly
+            for (int i = 0; i < (int)scene.lights.size(); ++i) {
+                finalColor = finalColor +
+                             directLight<SHADOWS_TRACED, Prims>(scene, options, i, hitPoint, normal, materialColor, sphereIdx);
+            }
+            return finalColor;
+        }
+        
+        if (Lights == LIGHTS_ONE) {
+            finalColor = finalColor + directLight<Shadows, Prims>(scene, options, 0, hitPoint, normal, materialColor, sphereIdx);
+        } else if (Lights == LIGHTS_MANY) {
+            for (int i = 0; i < (int)scene.lights.size(); ++i) {
+                finalColor = finalColor + directLight<Shadows, Prims>(scene, options, i, hitPoint, normal, materialColor, sphereIdx);
+            }
+        }
+        
+        return finalColor;
+    }
+    
+    // The single render loop, specialised at compile time. WriteIds fills
+    // options.sphereIdBuffer, which must then be non-null; Prims must cover
+    // scene.primitiveKinds().
+    template <RenderOutput Output, ShadowMode Shadows, LightClass Lights, bool WriteIds, unsigned Prims, class CameraT,
+              class ImageT>
+    static void renderKernel(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options,
+                             const Tile& tile) {
+        if (Output != OUTPUT_DISTANCE && !scene.materialPrograms.empty()) {
+            renderKernelBatched<Output, Shadows, Lights, WriteIds, Prims>(img, camera, scene, options, tile);
+            return;
+        }
+        
+        int n = options.samplesPerAxis;
+        int parity = options.checkerboardParity;
+        int step = parity >= 0 ? 2 : 1;
+        int* ids = options.sphereIdBuffer;
+        if (n <= 1) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                int first = parity >= 0 ? tile.x0 + ((tile.x0 + y + parity) & 1) : tile.x0;
+                for (int x = first; x < tile.x1; x += step) {
+                    Ray ray = camera.getRay(x, y, img.width, img.height);
+                    int* id = WriteIds ? ids + y * img.width + x : 0;
+                    img.setPixel(x, y, tracePrimary<Output, Shadows, Lights, WriteIds, Prims>(ray, scene, options, id));
+                }
+            }
+            return;
+        }
+        
+        // Supersampling: an n x n grid of sample points centered on the single-sample position.
+        // The id buffer receives the sphere seen by the last sample.
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            int first = parity >= 0 ? tile.x0 + ((tile.x0 + y + parity) & 1) : tile.x0;
+            for (int x = first; x < tile.x1; x += step) {
+                int* id = WriteIds ? ids + y * img.width + x : 0;
+                Vec3 sum(0, 0, 0);
+                for (int sy = 0; sy < n; ++sy) {
+                    for (int sx = 0; sx < n; ++sx) {
+                        Ray ray = camera.getRay(x + (sx + 0.5) / n - 0.5, y + (sy + 0.5) / n - 0.5, img.width, img.height);
+                        sum = sum + tracePrimary<Output, Shadows, Lights, WriteIds, Prims>(ray, scene, options, id);
+                    }
+                }
+                img.setPixel(x, y, sum / (n * n));
+            }
+        }
+    }
+    
+private:
+    // renderTile for one id-buffer setting: picks the primitive mask once for
+    // the whole tile. Only three masks are compiled, to bound the number of
+    // kernels: sphere-only scenes, any indexed mix, and unindexed scenes.
+    template <bool WriteIds, class CameraT, class ImageT>
+    static void renderPrimitives(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options,
+                                 const Tile& tile) {
+        unsigned kinds = scene.primitiveKinds();
+        if (kinds & Scene::PRIMS_UNINDEXED) {
+            renderVariant<WriteIds, Scene::PRIMS_ALL | Scene::PRIMS_UNINDEXED>(img, camera, scene, options, tile);
+        } else if (kinds == Scene::PRIMS_SPHERES) {
+            renderVariant<WriteIds, Scene::PRIMS_SPHERES>(img, camera, scene, options, tile);
+        } else {
+            renderVariant<WriteIds, Scene::PRIMS_ALL>(img, camera, scene, options, tile);
+        }
+    }
+    
+    // Picks the kernel for the output, shadow mode and light count
+    template <bool WriteIds, unsigned Prims, class CameraT, class ImageT>
+    static void renderVariant(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options,
+                              const Tile& tile) {
+        switch (options.output) {
+        case OUTPUT_DISTANCE:
+            renderKernel<OUTPUT_DISTANCE, SHADOWS_NONE, LIGHTS_NONE, WriteIds, Prims>(img, camera, scene, options, tile);
+            return;
+        case OUTPUT_MATERIAL:
+            renderKernel<OUTPUT_MATERIAL, SHADOWS_NONE, LIGHTS_NONE, WriteIds, Prims>(img, camera, scene, options, tile);
+            return;
+        case OUTPUT_BAKED:
+            renderKernel<OUTPUT_BAKED, SHADOWS_NONE, LIGHTS_NONE, WriteIds, Prims>(img, camera, scene, options, tile);
+            return;
+        case OUTPUT_SHADED:
+            break;
+        }
+        
+        if (!options.shadows) {
+            renderShaded<SHADOWS_NONE, WriteIds, Prims>(img, camera, scene, options, tile);
+        } else if (options.visibilityCache) {
+            renderShaded<SHADOWS_CACHED, WriteIds, Prims>(img, camera, scene, options, tile);
+        } else {
+            renderShaded<SHADOWS_TRACED, WriteIds, Prims>(img, camera, scene, options, tile);
+        }
+    }
+    
+    // A primary hit waiting for its material program
+    struct PendingHit {
+        int x;           // Pixel column
+        int sphereIdx;   // -1 on a miss
+        int program;
+        int slot;        // Position in its program's batch
+        Vec3 point, normal, color;
+    };
+    
+    // renderKernel for scenes with material programs: traces a tile row, runs each
+    // program once over all of the row's points that use it, then shades
+    template <RenderOutput Output, ShadowMode Shadows, LightClass Lights, bool WriteIds, unsigned Prims, class CameraT,
+              class ImageT>
+    static void renderKernelBatched(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options,
+                                    const Tile& tile) {
+        int n = std::max(1, options.samplesPerAxis);
+        int parity = options.checkerboardParity;
+        int step = parity >= 0 ? 2 : 1;
+        int* ids = options.sphereIdBuffer;
+        std::vector<PendingHit> hits;
+        std::vector<MaterialProgram::ShadingPoints> batches(scene.materialPrograms.size());
+        
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            hits.clear();
+            for (MaterialProgram::ShadingPoints& batch : batches) batch.clear();
+            
+            // Same sample positions as renderKernel; for n = 1 the offset is exactly 0
+            int first = parity >= 0 ? tile.x0 + ((tile.x0 + y + parity) & 1) : tile.x0;
+            for (int x = first; x < tile.x1; x += step) {
+                for (int sy = 0; sy < n; ++sy) {
+                    for (int sx = 0; sx < n; ++sx) {
+                        Ray ray = camera.getRay(x + (sx + 0.5) / n - 0.5, y + (sy + 0.5) / n - 0.5,
+                                                img.width, img.height);
+                        PendingHit hit;
+                        hit.x = x;
+                        hit.program = -1;
+                        double t;
+                        if (!scene.intersect<Prims>(ray, t, hit.sphereIdx)) hit.sphereIdx = -1;
+                        if (hit.sphereIdx >= 0) {
+                            hit.point = ray.at(t);
+                            Material material = scene.surfaceAt<Prims>(hit.sphereIdx, hit.point, hit.normal);
+                            hit.color = material.color;
+                            hit.program = material.program;
+                            if (hit.program >= 0) {
+                                hit.slot = (int)batches[hit.program].size();
+                                batches[hit.program].add(hit.point, hit.normal, hit.color);
+                            }
+                        }
+                        hits.push_back(hit);
+                    }
+                }
+            }
+            
+            for (size_t p = 0; p < batches.size(); ++p) {
+                if (batches[p].size() > 0) scene.materialPrograms[p].evaluate(batches[p]);
+            }
+            
+            for (size_t i = 0; i < hits.size(); i += n * n) {
+                Vec3 sum(0, 0, 0);
+                for (size_t k = i; k < i + n * n; ++k) {
+                    const PendingHit& hit = hits[k];
+                    if (hit.sphereIdx < 0) {
+                        sum = sum + background();
+                        continue;
+                    }
+                    Vec3 color = hit.program >= 0 ? batches[hit.program].color(hit.slot) : hit.color;
+                    sum = sum + shadeHit<Output, Shadows, Lights, Prims>(scene, options, hit.point, hit.normal, color, hit.sphereIdx);
+                }
+                const PendingHit& last = hits[i + n * n - 1];
+                if (WriteIds) ids[y * img.width + last.x] = last.sphereIdx;
+                img.setPixel(last.x, y, sum / (n * n));
+            }
+        }
+    }
+    
+    template <ShadowMode Shadows, bool WriteIds, unsigned Prims, class CameraT, class ImageT>
+    static void renderShaded(ImageT& img, const CameraT& camera, const Scene& scene, const RenderOptions& options,
+                             const Tile& tile) {
+        switch (classifyLights(scene)) {
+        case LIGHTS_NONE:
+            renderKernel<OUTPUT_SHADED, Shadows, LIGHTS_NONE, WriteIds, Prims>(img, camera, scene, options, tile);
+            break;
+        case LIGHTS_ONE:
+            renderKernel<OUTPUT_SHADED, Shadows, LIGHTS_ONE, WriteIds, Prims>(img, camera, scene, options, tile);
+            break;
+        case LIGHTS_MANY:
+            renderKernel<OUTPUT_SHADED, Shadows, LIGHTS_MANY, WriteIds, Prims>(img, camera, scene, options, tile);
+            break;
+        }
+    }
+    
+    static LightClass classifyLights(const Scene& scene) {
+        if (scene.lights.empty()) return LIGHTS_NONE;
+        return scene.lights.size() == 1 ? LIGHTS_ONE : LIGHTS_MANY;
+    }
+};
+
+// ===============
+// Relighter Class
+// ===============
+// Interactive relighting for a fixed camera and fixed geometry: primary hits
+// are cached once in a G-buffer, each light's shadowed diffuse contribution is
+// cached per pixel, and a light edit only re-traces that light's shadow rays.
+// resolve() sums the buffers in the same order as renderWithShadows, so the
+// result is identical to a full re-render.
+class Relighter {
+public:
+    // Per-pixel primary hit
+    struct GBufferTexel {
+        Vec3 position;
+        Vec3 normal;
+        Vec3 albedo;
+        bool hit;
+    };
+    
+    // Light passes run by rows on threadCount threads (0: one per core)
+    Relighter(const Camera& camera, Scene& scene, int width, int height, int threadCount = 0)
+        : scene(scene), width(width), height(height), gbuffer(width * height), pool(threadCount) {
+        // Material programs run once per row over all of the row's texels that
+        // use them, as in Renderer::renderKernelBatched
+        std::vector<MaterialProgram::ShadingPoints> batches(scene.materialPrograms.size());
+        std::vector<std::vector<int> > batchTexels(scene.materialPrograms.size());
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                Ray ray = camera.getRay(x, y, width, height);
+                GBufferTexel& texel = gbuffer[y * width + x];
+                double t;
+                int sphereIdx;
+                texel.hit = scene.intersect(ray, t, sphereIdx);
+                if (texel.hit) {
+                    texel.position = ray.at(t);
+                    Material material = scene.surfaceAt(sphereIdx, texel.position, texel.normal);
+                    texel.albedo = material.color;
+                    if (material.program >= 0) {
+                        batches[material.program].add(texel.position, texel.normal, material.color);
+                        batchTexels[material.program].push_back(y * width + x);
+                    }
+                }
+            }
+            for (size_t p = 0; p < batches.size(); ++p) {
+                if (batchTexels[p].empty()) continue;
+                scene.materialPrograms[p].evaluate(batches[p]);
+                for (size_t i = 0; i < batchTexels[p].size(); ++i) gbuffer[batchTexels[p][i]].albedo = batches[p].color(i);
+                batches[p].clear();
+                batchTexels[p].clear();
+            }
+        }
+        
+        lightContribution.resize(scene.lights.size());
+        for (size_t i = 0; i < scene.lights.size(); ++i) computeLight(i);
+    }
+    
+    // Light edits; each re-traces only the affected light
+    void setLight(size_t index, const Light& light) {
+        scene.lights[index] = light;
+        computeLight(index);
+    }
+    
+    size_t addLight(const Light& light) {
+        scene.addLight(light);
+        lightContribution.push_back(std::vector<Vec3>());
+        computeLight(scene.lights.size() - 1);
+        return scene.lights.size() - 1;
+    }
+    
+    void removeLight(size_t index) {
+        scene.lights.erase(scene.lights.begin() + index);
+        lightContribution.erase(lightContribution.begin() + index);
+    }
+    
+    // Ambient changes need no tracing at all
+    void setAmbient(const Vec3& ambient) { scene.ambientLight = ambient; }
+    
+    // Combine the cached contributions into an image of the constructor's size
+    void resolve(Image& img) const {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int p = y * width + x;
+                const GBufferTexel& texel = gbuffer[p];
+                if (!texel.hit) {
+                    img.setPixel(x, y, Renderer::background());
+                    continue;
+                }
+                Vec3 finalColor = scene.ambientLight * texel.albedo;
+                for (size_t i = 0; i < lightContribution.size(); ++i) {
+                    finalColor = finalColor + lightContribution[i][p];
+                }
+                img.setPixel(x, y, finalColor);
+            }
+        }
+    }
+    
+    const std::vector<GBufferTexel>& gBuffer() const { return gbuffer; }
+    
+private:
+    Scene& scene;
+    int width, height;
+    std::vector<GBufferTexel> gbuffer;
+    std::vector<std::vector<Vec3> > lightContribution; // [light][pixel]
+    ThreadPool pool; // Last, so workers stop before the buffers go away
+    
+    void computeLight(size_t index) {
+        std::vector<Vec3>& contribution = lightContribution[index];
+        contribution.assign(gbuffer.size(), Vec3(0, 0, 0));
+        const RenderOptions options;
+        for (int y = 0; y < height; ++y) {
+            pool.submit([this, &contribution, &options, index, y] {
+                for (int p = y * width; p < (y + 1) * width; ++p) {
+                    const GBufferTexel& texel = gbuffer[p];
+                    if (texel.hit) {
+                        contribution[p] = Renderer::directLight<SHADOWS_TRACED>(scene, options, (int)index, texel.position,
+                                                                                 texel.normal, texel.albedo, -1);
+                    }
+                }
+            });
+        }
+        pool.wait();
+    }
+};
+
+// ====================
+// Batch Renderer Class
+// ====================
+// One view of a batch: a camera, its projection and resolution, and what to render
+struct RenderView {
+    enum Projection {
+        PERSPECTIVE,
+        EQUIRECTANGULAR
+    };
+    
+    Projection projection;
+    Camera camera;                   // For PERSPECTIVE
+    EquirectangularCamera panorama;  // For EQUIRECTANGULAR
+    int width, height;
+    RenderOptions options;
+    std::string filename;            // Saved by BatchRenderer::renderAndSave when not empty
+    
+    static RenderView perspective(const Camera& camera, int width, int height,
+                                  const RenderOptions& options = RenderOptions(), const std::string& filename = "") {
+        return RenderView(PERSPECTIVE, camera, EquirectangularCamera(camera.position, camera.lookAt, camera.up),
+                          width, height, options, filename);
+    }
+    
+    static RenderView equirectangular(const EquirectangularCamera& panorama, int width, int height,
+                                      const RenderOptions& options = RenderOptions(), const std::string& filename = "") {
+        return RenderView(EQUIRECTANGULAR, Camera(panorama.position, panorama.lookAt, panorama.up, 90), panorama,
+                          width, height, options, filename);
+    }
+    
+    // Six square views, one per cube face; files are named <prefix>_<face>.ppm
+    static std::vector<RenderView> cubemap(const Vec3& position, int faceSize,
+                                           const RenderOptions& options = RenderOptions(), const std::string& prefix = "") {
+        const char* faceNames[6] = { "px", "nx", "py", "ny", "pz", "nz" };
+        std::vector<Camera> faces = Camera::cubemapFaces(position);
+        std::vector<RenderView> views;
+        for (int i = 0; i < 6; ++i) {
+            std::string filename = prefix.empty() ? "" : prefix + "_" + faceNames[i] + ".ppm";
+            views.push_back(perspective(faces[i], faceSize, faceSize, options, filename));
+        }
+        return views;
+    }
+    
+private:
+    RenderView(Projection projection, const Camera& camera, const EquirectangularCamera& panorama,
+               int width, int height, const RenderOptions& options, const std::string& filename)
+        : projection(projection), camera(camera), panorama(panorama),
+          width(width), height(height), options(options), filename(filename) {}
+};
+
+// Renders many views of one scene: the acceleration structure is built once and
+// the tiles of every view go through a single thread pool, so cores stay busy
+// across view boundaries instead of idling at the end of each image
+class BatchRenderer {
+public:
+    static std::vector<Image> render(Scene& scene, const std::vector<RenderView>& views,
+                                     int threadCount = 0, int tileSize = 32) {
+        if (!scene.bvhMatchesScene()) {
+            scene.buildBVH();
+        }
+        
+        std::vector<Image> images;
+        for (const RenderView& view : views) images.push_back(Image(view.width, view.height));
+        
+        ThreadPool pool(threadCount);
+        const Scene& sharedScene = scene;
+        for (size_t v = 0; v < views.size(); ++v) {
+            const RenderView* view = &views[v];
+            Image* img = &images[v];
+            std::vector<Tile> tiles = Tile::split(view->width, view->height, tileSize);
+            for (const Tile& tile : tiles) {
+                pool.submit([view, img, &sharedScene, tile] {
+                    if (view->projection == RenderView::EQUIRECTANGULAR) {
+                        Renderer::renderTile(*img, view->panorama, sharedScene, view->options, tile);
+                    } else {
+                        Renderer::renderTile(*img, view->camera, sharedScene, view->options, tile);
+                    }
+                });
+            }
+        }
+        pool.wait();
+        return images;
+    }
+    
+    // Render, then save every view that has a filename
+    static std::vector<Image> renderAndSave(Scene& scene, const std::vector<RenderView>& views,
+                                            int threadCount = 0, int tileSize = 32) {
+        std::vector<Image> images = render(scene, views, threadCount, tileSize);
+        for (size_t v = 0; v < views.size(); ++v) {
+            if (!views[v].filename.empty()) images[v].savePPM(views[v].filename);
+        }
+        return images;
+    }
+};
+
+// ===========================
+// Checkerboard Renderer Class
+// ===========================
+// Interactive preview that traces half the pixels per frame: frame k traces
+// pixels with (x + y + k) % 2 == 0, so two consecutive frames cover the image.
+// Each missing pixel is rebuilt from its four traced neighbours and from the
+// pixel's own trace one frame earlier, guided by the sphere-id buffer:
+//  - camera unchanged since the last frame: the previous trace is reused as is
+//    (call invalidateHistory() after editing the scene);
+//  - otherwise the neighbours are interpolated along the axis whose two
+//    samples hit the same sphere with the smaller color difference, so edges
+//    between spheres are not blurred across. When the previous trace hit the
+//    same sphere it is clamped to the neighbours' color range and blended in.
+class CheckerboardRenderer {
+public:
+    CheckerboardRenderer(int width, int height)
+        : width(width), height(height), frame(0), historyValid(false),
+          traced(width, height), output(width, height), ids(width * height, -1),
+          lastCamera(Vec3(0, 0, 0), Vec3(0, 0, -1), Vec3(0, 1, 0), 0) {}
+    
+    // Render the next frame; with a pool the traced half is split into tiles
+    const Image& renderFrame(const Camera& camera, const Scene& scene, const RenderOptions& options,
+                             ThreadPool* pool = 0, int tileSize = 32) {
+        bool staticView = historyValid && sameView(camera, lastCamera);
+        
+        RenderOptions frameOptions = options;
+        frameOptions.checkerboardParity = frame & 1;
+        frameOptions.sphereIdBuffer = &ids[0];
+        if (pool) {
+            std::vector<Tile> tiles = Tile::split(width, height, tileSize);
+            for (const Tile& tile : tiles) {
+                pool->submit([this, &camera, &scene, &frameOptions, tile] {
+                    Renderer::renderTile(traced, camera, scene, frameOptions, tile);
+                });
+            }
+            pool->wait();
+        } else {
+            Renderer::render(traced, camera, scene, frameOptions);
+        }
+        
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                bool wasTraced = ((x + y) & 1) == (frame & 1);
+                output.setPixel(x, y, wasTraced ? traced.getPixel(x, y)
+                                                : reconstruct(x, y, staticView));
+            }
+        }
+        
+        // The untouched half of `traced` and `ids` now holds this frame's history
+        lastCamera = camera;
+        historyValid = true;
+        frame++;
+        return output;
+    }
+    
+    void invalidateHistory() { historyValid = false; }
+    
+    const Image& image() const { return output; }
+    
+    // Sphere index per traced pixel (this frame's half) or per pixel traced last frame
+    const std::vector<int>& sphereIds() const { return ids; }
+    
+private:
+    int width, height;
+    int frame;
+    bool historyValid;
+    Image traced;       // Last traced value of every pixel, from this frame or the one before
+    Image output;
+    std::vector<int> ids;
+    Camera lastCamera;
+    
+    static bool sameView(const Camera& a, const Camera& b) {
+        return a.position.x() == b.position.x() && a.position.y() == b.position.y() && a.position.z() == b.position.z() &&
+               a.lookAt.x() == b.lookAt.x() && a.lookAt.y() == b.lookAt.y() && a.lookAt.z() == b.lookAt.z() &&
+               a.up.x() == b.up.x() && a.up.y() == b.up.y() && a.up.z() == b.up.z() && a.fov == b.fov;
+    }
+    
+    static double difference(const Vec3& a, const Vec3& b) {
+        return std::fabs(a.x() - b.x()) + std::fabs(a.y() - b.y()) + std::fabs(a.z() - b.z());
+    }
+    
+    // Missing pixels were not traced this frame, so traced and ids still hold their previous trace
+    Vec3 reconstruct(int x, int y, bool staticView) const {
+        if (staticView) return traced.getPixel(x, y);
+        int previousId = ids[y * width + x];
+        
+        // Neighbours left, right, up, down; out-of-image ones mirror the opposite side
+        int nx[4] = { x > 0 ? x - 1 : x + 1, x < width - 1 ? x + 1 : x - 1, x, x };
+        int ny[4] = { y, y, y > 0 ? y - 1 : y + 1, y < height - 1 ? y + 1 : y - 1 };
+        Vec3 colors[4];
+        int neighbourIds[4];
+        for (int i = 0; i < 4; ++i) {
+            if (nx[i] < 0 || nx[i] >= width || ny[i] < 0 || ny[i] >= height) {
+                // 1-pixel-wide or -tall image: no neighbour on this axis
+                colors[i] = traced.getPixel(x, y);
+                neighbourIds[i] = previousId;
+            } else {
+                colors[i] = traced.getPixel(nx[i], ny[i]);
+                neighbourIds[i] = ids[ny[i] * width + nx[i]];
+            }
+        }
+        
+        bool horizontal = neighbourIds[0] == neighbourIds[1];
+        bool vertical = neighbourIds[2] == neighbourIds[3];
+        double dh = difference(colors[0], colors[1]);
+        double dv = difference(colors[2], colors[3]);
+        Vec3 spatial;
+        int id;
+        if (horizontal && vertical && neighbourIds[0] == neighbourIds[2]) {
+            // Flat region: weight each axis by the other's gradient
+            double wh = dv + 1e-6, wv = dh + 1e-6;
+            spatial = ((colors[0] + colors[1]) * wh + (colors[2] + colors[3]) * wv) / (2.0 * (wh + wv));
+            id = neighbourIds[0];
+        } else if (horizontal && (!vertical || dh <= dv)) {
+            spatial = (colors[0] + colors[1]) * 0.5;
+            id = neighbourIds[0];
+        } else if (vertical) {
+            spatial = (colors[2] + colors[3]) * 0.5;
+            id = neighbourIds[2];
+        } else {
+            // No axis agrees: prefer a neighbour on the sphere this pixel saw last frame,
+            // falling back to the left one
+            int best = 0;
+            for (int i = 1; i < 4; ++i) {
+                if (neighbourIds[i] == previousId && neighbourIds[best] != previousId) best = i;
+            }
+            spatial = colors[best];
+            id = neighbourIds[best];
+        }
+        
+        if (!historyValid || previousId != id) return spatial;
+        
+        // Same sphere as last frame: blend in the previous trace, clamped to the neighbourhood
+        Vec3 lo = colors[0], hi = colors[0];
+        for (int i = 1; i < 4; ++i) {
+            lo = Vec3(std::min(lo.x(), colors[i].x()), std::min(lo.y(), colors[i].y()), std::min(lo.z(), colors[i].z()));
+            hi = Vec3(std::max(hi.x(), colors[i].x()), std::max(hi.y(), colors[i].y()), std::max(hi.z(), colors[i].z()));
+        }
+        Vec3 previous = traced.getPixel(x, y);
+        previous = Vec3(std::min(std::max(previous.x(), lo.x()), hi.x()), std::min(std::max(previous.y(), lo.y()), hi.y()),
+                        std::min(std::max(previous.z(), lo.z()), hi.z()));
+        return (spatial + previous) * 0.5;
+    }
+};
+
+// ============================
+// Variable Rate Renderer Class
+// ============================
+// Importance in [0, 1] per square tile of the image
+struct ImportanceMap {
+    int tileSize, tilesX, tilesY;
+    std::vector<float> values;
+    long long probeRays; // Primary rays traced to build the map (fromAOVs)
+    
+    ImportanceMap(int width, int height, int tileSize = 16, float value = 1.0f)
+        : tileSize(tileSize), tilesX((width + tileSize - 1) / tileSize), tilesY((height + tileSize - 1) / tileSize),
+          values(tilesX * tilesY, value), probeRays(0) {}
+    
+    float get(int tx, int ty) const { return values[ty * tilesX + tx]; }
+    void set(int tx, int ty, float v) { values[ty * tilesX + tx] = std::min(1.0f, std::max(0.0f, v)); }
+    
+    // User-painted mask: mean luminance of each tile
+    static ImportanceMap fromImage(const Image& mask, int tileSize = 16) {
+        ImportanceMap map(mask.width, mask.height, tileSize);
+        for (int ty = 0; ty < map.tilesY; ++ty) {
+            for (int tx = 0; tx < map.tilesX; ++tx) {
+                double sum = 0;
+                int count = 0;
+                for (int y = ty * tileSize; y < std::min((ty + 1) * tileSize, mask.height); ++y) {
+                    for (int x = tx * tileSize; x < std::min((tx + 1) * tileSize, mask.width); ++x) {
+                        Vec3 c = mask.getPixel(x, y);
+                        sum += 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+                        count++;
+                    }
+                }
+                map.set(tx, ty, (float)(sum / std::max(1, count)));
+            }
+        }
+        return map;
+    }
+    
+    // Derived from a 4 x 4 probe of sphere ids and depths per tile: tiles with a
+    // silhouette (more than one id) or strong depth change get full importance,
+    // smooth tiles fall back to a weight that is highest at the frame center
+    static ImportanceMap fromAOVs(const Scene& scene, const Camera& camera, int width, int height,
+                                  int tileSize = 16, double centerWeight = 0.75) {
+        ImportanceMap map(width, height, tileSize);
+        for (int ty = 0; ty < map.tilesY; ++ty) {
+            for (int tx = 0; tx < map.tilesX; ++tx) {
+                int x0 = tx * tileSize, y0 = ty * tileSize;
+                int x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+                int firstId = -2;
+                bool silhouette = false;
+                double tMin = std::numeric_limits<double>::infinity(), tMax = 0;
+                for (int j = 0; j < 4; ++j) {
+                    for (int i = 0; i < 4; ++i) {
+                        Ray ray = camera.getRay(x0 + (x1 - x0) * (i + 0.5) / 4, y0 + (y1 - y0) * (j + 0.5) / 4, width, height);
+                        double t;
+                        int sphereIdx;
+                        if (!scene.intersect(ray, t, sphereIdx)) sphereIdx = -1;
+                        else { tMin = std::min(tMin, t); tMax = std::max(tMax, t); }
+                        if (firstId == -2) firstId = sphereIdx;
+                        else if (sphereIdx != firstId) silhouette = true;
+                    }
+                }
+                double depthChange = tMax > 0 ? (tMax - tMin) / tMax : 0.0;
+                double dx = (0.5 * (x0 + x1) - 0.5 * width) / (0.5 * width);
+                double dy = (0.5 * (y0 + y1) - 0.5 * height) / (0.5 * height);
+                double center = std::max(0.0, 1.0 - std::sqrt(0.5 * (dx * dx + dy * dy)));
+                double content = silhouette ? 1.0 : std::min(1.0, depthChange * 4.0);
+                map.set(tx, ty, (float)std::max(content, center * centerWeight));
+            }
+        }
+        map.probeRays = (long long)map.tilesX * map.tilesY * 16;
+        return map;
+    }
+};
+
+// Renders each tile of an ImportanceMap at its own rate. Low-importance tiles
+// trace one ray per 2 x 2 or 4 x 4 pixel block (shading rate) and are upsampled
+// bilinearly; high-importance tiles get n x n supersampling (sampling rate).
+// Upsampling only sees the tile's own samples, so the outer half block of a
+// coarse tile is held constant and a seam can show where it meets a tile
+// rendered at another rate.
+class VariableRateRenderer {
+public:
+    struct Rate {
+        int pixelsPerSample;   // Shading rate: 1, 2 or 4 pixels per traced sample along each axis
+        int samplesPerAxis;    // Sampling rate at full shading rate
+    };
+    
+    // Importance thresholds: < 0.2 -> 4x4 blocks, < 0.45 -> 2x2 blocks, < 0.9 -> 1 spp, else 4 spp
+    static Rate rateFor(float importance) {
+        Rate rate = { 1, 1 };
+        if (importance < 0.2f) rate.pixelsPerSample = 4;
+        else if (importance < 0.45f) rate.pixelsPerSample = 2;
+        else if (importance >= 0.9f) rate.samplesPerAxis = 2;
+        return rate;
+    }
+    
+    // Returns the number of primary rays traced, including the importance map's probe rays
+    static long long render(Image& img, const Camera& camera, const Scene& scene, const RenderOptions& options,
+                            const ImportanceMap& importance, ThreadPool* pool = 0) {
+        std::atomic<long long> rays(0);
+        for (int ty = 0; ty < importance.tilesY; ++ty) {
+            for (int tx = 0; tx < importance.tilesX; ++tx) {
+                int size = importance.tileSize;
+                Tile tile(tx * size, ty * size, std::min((tx + 1) * size, img.width), std::min((ty + 1) * size, img.height));
+                Rate rate = rateFor(importance.get(tx, ty));
+                if (pool) {
+                    pool->submit([&img, &camera, &scene, &options, tile, rate, &rays] {
+                        rays += renderTile(img, camera, scene, options, tile, rate);
+                    });
+                } else {
+                    rays += renderTile(img, camera, scene, options, tile, rate);
+                }
+            }
+        }
+        if (pool) pool->wait();
+        return rays.load() + importance.probeRays;
+    }
+    
+private:
+    // Maps a coarse image over one tile onto the full-resolution camera:
+    // coarse pixel (u, v) is the center of a pixelsPerSample-sized block
+    struct CoarseCamera {
+        const Camera& camera;
+        Tile tile;
+        int scale, width, height;
+        
+        CoarseCamera(const Camera& camera, const Tile& tile, int scale, int width, int height)
+            : camera(camera), tile(tile), scale(scale), width(width), height(height) {}
+        
+        Ray getRay(double u, double v, int, int) const {
+            return camera.getRay(tile.x0 + (u + 0.5) * scale - 0.5, tile.y0 + (v + 0.5) * scale - 0.5, width, height);
+        }
+    };
+    
+    static long long renderTile(Image& img, const Camera& camera, const Scene& scene, const RenderOptions& options,
+                                const Tile& tile, const Rate& rate) {
+        RenderOptions tileOptions = options;
+        tileOptions.samplesPerAxis = rate.samplesPerAxis;
+        if (rate.pixelsPerSample == 1) {
+            Renderer::renderTile(img, camera, scene, tileOptions, tile);
+            return (long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * rate.samplesPerAxis * rate.samplesPerAxis;
+        }
+        
+        // The coarse image has its own coordinates: every coarse pixel is
+        // rendered, and sphere ids go to a coarse buffer that is spread over the
+        // tile by nearest sample
+        int scale = rate.pixelsPerSample;
+        Image coarse((tile.x1 - tile.x0 + scale - 1) / scale, (tile.y1 - tile.y0 + scale - 1) / scale);
+        std::vector<int> coarseIds(options.sphereIdBuffer ? (size_t)coarse.width * coarse.height : 0);
+        tileOptions.checkerboardParity = -1;
+        tileOptions.sphereIdBuffer = coarseIds.empty() ? 0 : &coarseIds[0];
+        Renderer::render(coarse, CoarseCamera(camera, tile, scale, img.width, img.height), scene, tileOptions);
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                img.setPixel(x, y, coarse.sample((x - tile.x0 + 0.5) / scale - 0.5, (y - tile.y0 + 0.5) / scale - 0.5));
+                if (!coarseIds.empty()) {
+                    int index = (y - tile.y0) / scale * coarse.width + (x - tile.x0) / scale;
+                    options.sphereIdBuffer[y * img.width + x] = coarseIds[index];
+                }
+            }
+        }
+        return (long long)coarse.width * coarse.height;
+    }
+};
+
+// ================
+// BVH Report Class
+// ================
+// Quality report for Scene::bvh, to tell a poor hierarchy apart from other
+// causes of a slow render. Traversal figures come from a sampled render
+// (primary plus shadow rays on every sampleStride-th pixel in each direction),
+// which runs first so a lazy hierarchy reports the part rays actually built.
+class BVHReport {
+public:
+    // Tree shape
+    int interiorNodes, leafNodes, unsplitNodes, maxDepth;
+    std::vector<int> leavesPerDepth; // [depth]
+    std::vector<int> leafSizes;      // [primitive count]
+    double sahCost;                  // Traversal = primitive test = 1, relative to the root's area
+    double meanOverlap, maxOverlap;  // Child-box intersection area over parent area
+    double bytesPerPrimitive;
+    
+    // Sampled render
+    TraversalStats stats;
+    
+    static BVHReport analyze(const Scene& scene, const Camera& camera, int width, int height, int sampleStride = 4) {
+        BVHReport report;
+        for (int y = 0; y < height; y += sampleStride) {
+            for (int x = 0; x < width; x += sampleStride) {
+                Ray ray = camera.getRay(x, y, width, height);
+                double t;
+                int sphereIdx;
+                if (!scene.intersectCounted(ray, t, sphereIdx, report.stats)) continue;
+                Vec3 hitPoint = ray.at(t);
+                for (const Light& light : scene.lights) {
+                    Vec3 toLight = light.position - hitPoint;
+                    double shadowT;
+                    int occluder;
+                    scene.intersectCounted(Ray(hitPoint, toLight), shadowT, occluder, report.stats);
+                }
+            }
+        }
+        
+        const BVH& bvh = scene.bvh;
+        if (bvh.primitiveCount() == 0 || !scene.bvhMatchesScene()) return report;
+        
+        double rootArea = bvh.node(0).bounds.surfaceArea();
+        double overlapSum = 0;
+        std::vector<std::pair<int, int> > pending(1, std::make_pair(0, 0));
+        while (!pending.empty()) {
+            int index = pending.back().first;
+            int depth = pending.back().second;
+            pending.pop_back();
+            const BVH::Node& node = bvh.node(index);
+            double areaRatio = rootArea > 0 ? node.bounds.surfaceArea() / rootArea : 1.0;
+            report.maxDepth = std::max(report.maxDepth, depth);
+            
+            int state = node.state.load(std::memory_order_acquire);
+            if (state == BVH::NODE_INTERIOR) {
+                report.interiorNodes++;
+                report.sahCost += areaRatio;
+                const AABB& a = bvh.node(node.left).bounds;
+                const AABB& b = bvh.node(node.left + 1).bounds;
+                AABB shared(Vec3(std::max(a.pMin.x(), b.pMin.x()), std::max(a.pMin.y(), b.pMin.y()), std::max(a.pMin.z(), b.pMin.z())),
+                            Vec3(std::min(a.pMax.x(), b.pMax.x()), std::min(a.pMax.y(), b.pMax.y()), std::min(a.pMax.z(), b.pMax.z())));
+                double overlap = node.bounds.surfaceArea() > 0 ? shared.surfaceArea() / node.bounds.surfaceArea() : 0.0;
+                overlapSum += overlap;
+                report.maxOverlap = std::max(report.maxOverlap, overlap);
+                pending.push_back(std::make_pair(node.left, depth + 1));
+                pending.push_back(std::make_pair(node.left + 1, depth + 1));
+            } else {
+                // Unsplit lazy nodes are costed as the leaves they currently act as
+                if (state == BVH::NODE_LEAF) report.leafNodes++; else report.unsplitNodes++;
+                report.sahCost += areaRatio * node.count;
+                if ((int)report.leavesPerDepth.size() <= depth) report.leavesPerDepth.resize(depth + 1, 0);
+                report.leavesPerDepth[depth]++;
+                if ((int)report.leafSizes.size() <= node.count) report.leafSizes.resize(node.count + 1, 0);
+                report.leafSizes[node.count]++;
+            }
+        }
+        report.meanOverlap = report.interiorNodes > 0 ? overlapSum / report.interiorNodes : 0.0;
+        report.bytesPerPrimitive = (double)bvh.memoryBytes() / bvh.primitiveCount();
+        return report;
+    }
+    
+    void print(std::ostream& out) const {
+        out << "BVH quality report" << std::endl;
+        out << "  Nodes: " << interiorNodes << " interior, " << leafNodes << " leaves";
+        if (unsplitNodes > 0) out << ", " << unsplitNodes << " unsplit (lazy)";
+        out << std::endl;
+        out << "  SAH cost: " << sahCost << std::endl;
+        out << "  Child overlap: mean " << meanOverlap * 100 << "%, max " << maxOverlap * 100 << "%" << std::endl;
+        out << "  Memory: " << bytesPerPrimitive << " bytes per primitive" << std::endl;
+        out << "  Max depth: " << maxDepth << std::endl;
+        
+        out << "  Leaves per depth:" << std::endl;
+        for (size_t d = 0; d < leavesPerDepth.size(); ++d) {
+            if (leavesPerDepth[d] > 0) out << "    " << d << ": " << leavesPerDepth[d] << std::endl;
+        }
+        out << "  Leaf sizes:" << std::endl;
+        for (size_t n = 0; n < leafSizes.size(); ++n) {
+            if (leafSizes[n] > 0) out << "    " << n << " primitives: " << leafSizes[n] << std::endl;
+        }
+        
+        double rays = stats.rays > 0 ? (double)stats.rays : 1.0;
+        out << "  Sampled rays: " << stats.rays << std::endl;
+        out << "  Nodes visited per ray: " << stats.nodesVisited / rays << std::endl;
+        out << "  Primitive tests per ray: " << stats.primitiveTests / rays << std::endl;
+    }
+    
+private:
+    BVHReport()
+        : interiorNodes(0), leafNodes(0), unsplitNodes(0), maxDepth(0),
+          sahCost(0), meanOverlap(0), maxOverlap(0), bytesPerPrimitive(0) {}
+};
+
+// =====================
+// Budget Renderer Class
+// =====================
+// Quality levels, cheapest first
+struct QualityLevel {
+    int resolutionDivisor; // Render at 1/divisor resolution and upscale
+    int samplesPerAxis;
+    
+    QualityLevel(int resolutionDivisor, int samplesPerAxis)
+        : resolutionDivisor(resolutionDivisor), samplesPerAxis(samplesPerAxis) {}
+};
+
+struct BudgetResult {
+    QualityLevel quality;  // Level chosen for the final pass
+    bool completed;        // False when the deadline or a cancel cut the final pass short
+    double seconds;
+    
+    BudgetResult() : quality(4, 1), completed(false), seconds(0) {}
+};
+
+// "Best image within N seconds". A quarter-resolution probe pass is rendered
+// first; it measures the cost per sample and doubles as the fallback image.
+// The best quality level predicted to fit in the remaining budget then renders
+// tile by tile on a thread pool. Tiles check the deadline and the cancel flag
+// before they start, and any tile that never ran is filled from the upscaled
+// probe, so the returned image is always complete.
+class BudgetRenderer {
+public:
+    // Longer budgets are clamped (as are negative and NaN ones, to 0) so the
+    // deadline fits the clock's integer duration
+    static constexpr double MAX_BUDGET_SECONDS = 1e8;
+    
+    static BudgetResult render(Image& img, const Camera& camera, const Scene& scene, const RenderOptions& options,
+                               double budgetSeconds, const std::atomic<bool>* cancel = 0,
+                               int threadCount = 0, int tileSize = 32) {
+        typedef std::chrono::steady_clock Clock;
+        if (!(budgetSeconds >= 0)) budgetSeconds = 0;
+        if (budgetSeconds > MAX_BUDGET_SECONDS) budgetSeconds = MAX_BUDGET_SECONDS;
+        Clock::time_point start = Clock::now();
+        Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+                                                 std::chrono::duration<double>(budgetSeconds));
+        ThreadPool pool(threadCount);
+        BudgetResult result;
+        
+        // Probe pass, always completed
+        Image probe(std::max(1, img.width / 4), std::max(1, img.height / 4));
+        RenderOptions probeOptions = options;
+        probeOptions.samplesPerAxis = 1;
+        renderTiles(pool, probe, camera, scene, probeOptions, tileSize, 0, Clock::time_point::max(), 0);
+        double probeSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double secondsPerSample = probeSeconds / ((double)probe.width * probe.height);
+        
+        // Best level predicted to fit, with 25% headroom
+        double remaining = budgetSeconds - probeSeconds;
+        const QualityLevel ladder[] = { QualityLevel(2, 1), QualityLevel(1, 1), QualityLevel(1, 2),
+                                        QualityLevel(1, 3), QualityLevel(1, 4) };
+        bool useProbe = true;
+        for (const QualityLevel& level : ladder) {
+            double samples = (double)std::max(1, img.width / level.resolutionDivisor) *
+                             std::max(1, img.height / level.resolutionDivisor) *
+                             level.samplesPerAxis * level.samplesPerAxis;
+            if (samples * secondsPerSample * 1.25 > remaining) break;
+            result.quality = level;
+            useProbe = false;
+        }
+        
+        if (useProbe) {
+            upscaleInto(img, probe, Tile(0, 0, img.width, img.height));
+            result.completed = true;
+        } else {
+            int divisor = result.quality.resolutionDivisor;
+            RenderOptions finalOptions = options;
+            finalOptions.samplesPerAxis = result.quality.samplesPerAxis;
+            Image target(std::max(1, img.width / divisor), std::max(1, img.height / divisor));
+            std::vector<char> done;
+            renderTiles(pool, target, camera, scene, finalOptions, tileSize, cancel, deadline, &done);
+            
+            // Assemble: finished tiles from the final pass, everything else from the probe
+            std::vector<Tile> tiles = Tile::split(target.width, target.height, tileSize);
+            result.completed = true;
+            for (size_t i = 0; i < tiles.size(); ++i) {
+                Tile full(tiles[i].x0 * divisor, tiles[i].y0 * divisor,
+                          tiles[i].x1 == target.width ? img.width : tiles[i].x1 * divisor,
+                          tiles[i].y1 == target.height ? img.height : tiles[i].y1 * divisor);
+                if (done[i]) {
+                    upscaleInto(img, target, full);
+                } else {
+                    upscaleInto(img, probe, full);
+                    result.completed = false;
+                }
+            }
+        }
+        
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        return result;
+    }
+    
+private:
+    // Render all tiles; with `done`, tiles starting after the deadline or a cancel are skipped
+    static void renderTiles(ThreadPool& pool, Image& img, const Camera& camera, const Scene& scene,
+                            const RenderOptions& options, int tileSize, const std::atomic<bool>* cancel,
+                            std::chrono::steady_clock::time_point deadline, std::vector<char>* done) {
+        std::vector<Tile> tiles = Tile::split(img.width, img.height, tileSize);
+        if (done) done->assign(tiles.size(), 0);
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            Tile tile = tiles[i];
+            char* flag = done ? &(*done)[i] : 0;
+            pool.submit([&img, &camera, &scene, &options, tile, flag, cancel, deadline] {
+                if (flag && ((cancel && cancel->load()) || std::chrono::steady_clock::now() >= deadline)) return;
+                Renderer::renderTile(img, camera, scene, options, tile);
+                if (flag) *flag = 1;
+            });
+        }
+        pool.wait();
+    }
+    
+    static void upscaleInto(Image& img, const Image& source, const Tile& tile) {
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                bool sameSize = source.width == img.width && source.height == img.height;
+                img.setPixel(x, y, sameSize ? source.getPixel(x, y) : source.sampleScaled(x, y, img.width, img.height));
+            }
+        }
+    }
+};
+
+// ==========================
+// Out-of-Core Renderer Class
+// ==========================
+// Renders images too large for an Image. Rows are rendered a band at a time
+// into a ring buffer, quantised and appended to a binary PPM as soon as every
+// row under their filter footprint exists, so memory holds
+// bandRows + 2 * filterRadius rows whatever the image height.
+//
+// filterRadius > 0 applies a separable tent filter of that radius in pixels
+// before quantising. Row y then needs rows y - r .. y + r, so the last r rows
+// of a band are held back until the next band is rendered, and the ring keeps
+// the r rows above the oldest unwritten row. The result is identical to
+// filtering the whole image at once; radius 0 writes the kernel's pixels.
+class OutOfCoreRenderer {
+public:
+    // Image-like ring of rows; the renderer writes through setPixel with
+    // full-image coordinates, and row y lives in slot y % rows
+    struct RowRing {
+        int width, height;
+        int rows;
+        std::vector<Vec3> pixels;
+        
+        RowRing(int width, int height, int rows)
+            : width(width), height(height), rows(rows), pixels((size_t)width * rows) {}
+        
+        void setPixel(int x, int y, const Vec3& color) {
+            if (x >= 0 && x < width && y >= 0 && y < height) row(y)[x] = color;
+        }
+        
+        Vec3* row(int y) { return &pixels[(size_t)(y % rows) * width]; }
+    };
     
-    // Save as PPM format (simple, no library needed)
-    void savePPM(const std::string& filename) const {
-        std::ofstream file(filename);
-        file << "P3\n" << width << " " << height << "\n255\n";
+    // Render width x height pixels to a binary PPM; false with a message if the
+    // file cannot be written, the filter radius exceeds the image or the ring
+    // does not fit in memory
+    template <class CameraT>
+    static bool render(const std::string& filename, int width, int height, const CameraT& camera,
+                       const Scene& scene, const RenderOptions& options, std::string& error,
+                       int bandRows = 32, int filterRadius = 0, int threadCount = 0, int tileSize = 32) {
+        bandRows = std::max(1, bandRows);
+        int radius = std::max(0, filterRadius);
+        if (radius > std::max(width, height)) {
+            error = "Filter radius larger than the image";
+            return false;
+        }
+        // A ring of height rows never wraps onto a row still in use
+        size_t rows = std::min(ringRows(bandRows, radius), (size_t)std::max(1, height));
+        if ((size_t)std::max(1, width) > std::numeric_limits<size_t>::max() / sizeof(Vec3) / rows) {
+            error = "Row buffer too large for this machine";
+            return false;
+        }
         
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                Vec3 color = getPixel(x, y);
-                // Clamp values to [0, 1] and convert to [0, 255]
-                int r = std::min(255, std::max(0, (int)(color.x * 255)));
-                int g = std::min(255, std::max(0, (int)(color.y * 255)));
-                int b = std::min(255, std::max(0, (int)(color.z * 255)));
-                file << r << " " << g << " " << b << " ";
-            }
-            file << "\n";
+        std::ofstream file(filename.c_str(), std::ios::binary);
+        if (!file) {
+            error = "Could not create " + filename;
+            return false;
         }
+        file << "P6\n" << width << " " << height << "\n255\n";
         
+        RowRing ring(width, height, (int)rows);
+        std::vector<Vec3> column(radius > 0 ? width : 0), filtered(width);
+        std::vector<unsigned char> bytes((size_t)width * 3);
+        ThreadPool pool(threadCount);
+        int written = 0;
+        for (int y0 = 0; y0 < height; y0 += bandRows) {
+            int y1 = std::min(y0 + bandRows, height);
+            for (int x = 0; x < width; x += tileSize) {
+                Tile tile(x, y0, std::min(x + tileSize, width), y1);
+                pool.submit([&ring, &camera, &scene, &options, tile] { Renderer::renderTile(ring, camera, scene, options, tile); });
+            }
+            pool.wait();
+            
+            // Rows whose whole footprint has been rendered
+            int ready = y1 == height ? height : y1 - radius;
+            for (; written < ready; ++written) {
+                filterRow(ring, written, radius, column, filtered);
+                for (int x = 0; x < width; ++x) {
+                    const Vec3& color = filtered[x];
+                    bytes[3 * x + 0] = (unsigned char)std::min(255, std::max(0, (int)(color.x() * 255)));
+                    bytes[3 * x + 1] = (unsigned char)std::min(255, std::max(0, (int)(color.y() * 255)));
+                    bytes[3 * x + 2] = (unsigned char)std::min(255, std::max(0, (int)(color.z() * 255)));
+                }
+                file.write((const char*)&bytes[0], (std::streamsize)bytes.size());
+            }
+            if (!file) {
+                error = "Could not write " + filename;
+                return false;
+            }
+        }
         file.close();
+        if (!file) {
+            error = "Could not write " + filename;
+            return false;
+        }
+        return true;
+    }
+    
+    // Bytes held in memory for a render, independent of the image height
+    static size_t workingSetBytes(int width, int bandRows, int filterRadius) {
+        size_t rows = ringRows(std::max(1, bandRows), std::max(0, filterRadius));
+        size_t scratchRows = filterRadius > 0 ? 2 : 1;
+        return (size_t)width * ((rows + scratchRows) * sizeof(Vec3) + 3);
+    }
+    
+private:
+    // bandRows + 2 * radius, saturating instead of overflowing
+    static size_t ringRows(int bandRows, int radius) {
+        const size_t limit = std::numeric_limits<size_t>::max();
+        if ((size_t)radius > (limit - (size_t)bandRows) / 2) return limit;
+        return (size_t)bandRows + 2 * (size_t)radius;
+    }
+    
+    // Tent-filter row y into out: vertically over the ring into column, then
+    // horizontally, clamping to the image edges. Radius 0 copies the row unchanged.
+    static void filterRow(RowRing& ring, int y, int radius, std::vector<Vec3>& column, std::vector<Vec3>& out) {
+        if (radius == 0) {
+            std::copy(ring.row(y), ring.row(y) + ring.width, out.begin());
+            return;
+        }
+        std::fill(column.begin(), column.end(), Vec3(0, 0, 0));
+        for (int d = -radius; d <= radius; ++d) {
+            const Vec3* source = ring.row(std::min(std::max(y + d, 0), ring.height - 1));
+            double weight = radius + 1 - std::abs(d);
+            for (int x = 0; x < ring.width; ++x) column[x] = column[x] + source[x] * weight;
+        }
+        double norm = 1.0 / ((double)(radius + 1) * (radius + 1) * (radius + 1) * (radius + 1));
+        for (int x = 0; x < ring.width; ++x) {
+            Vec3 sum(0, 0, 0);
+            for (int d = -radius; d <= radius; ++d) {
+                sum = sum + column[std::min(std::max(x + d, 0), ring.width - 1)] * (double)(radius + 1 - std::abs(d));
+            }
+            out[x] = sum * norm;
+        }
     }
 };
 
-// ==============
-// Renderer Class
-// ==============
-class Renderer {
+// ================
+// Auto Tuner Class
+// ================
+// Settings the tuner chooses between
+struct RenderSettings {
+    int tileSize;
+    int threadCount;
+    int leafSize;
+    
+    RenderSettings(int tileSize = 32, int threadCount = 0, int leafSize = 4)
+        : tileSize(tileSize), threadCount(threadCount), leafSize(leafSize) {}
+};
+
+// Picks tile size, thread count and BVH leaf size by timing short renders of
+// the actual scene: the central quarter of the image at full resolution, best
+// of two runs per grid point. The winner is cached in a text file keyed by a
+// machine fingerprint (CPU model, hardware threads) and a scene fingerprint
+// (geometry, lights, resolution, output), so later runs skip the search.
+class AutoTuner {
 public:
-    // Step b: Render distance to closest sphere
-    static void renderDistance(Image& img, const Camera& camera, const Scene& scene) {
-        for (int y = 0; y < img.height; ++y) {
-            for (int x = 0; x < img.width; ++x) {
-                Ray ray = camera.getRay(x, y, img.width, img.height);
-                
-                double t;
-                int sphereIdx;
-                if (scene.intersect(ray, t, sphereIdx)) {
-                    // Encode distance as color (normalize to reasonable range)
-                    double normalizedDist = 1.0 - std::min(1.0, t / 20.0);
-                    Vec3 color(normalizedDist, normalizedDist, normalizedDist);
-                    img.setPixel(x, y, color);
-                } else {
-                    // Background color (sky blue)
-                    img.setPixel(x, y, Vec3(0.5, 0.7, 1.0));
+    static RenderSettings tune(Scene& scene, const Camera& camera, int width, int height,
+                               const RenderOptions& options, const std::string& cachePath = "raytracer_tune.cache",
+                               bool verbose = false) {
+        unsigned long long machine = machineFingerprint();
+        unsigned long long sceneKey = sceneFingerprint(scene, width, height, options);
+        RenderSettings best;
+        if (loadCached(cachePath, machine, sceneKey, best)) {
+            if (verbose) std::cout << "  Auto-tune: using cached settings" << std::endl;
+            scene.buildBVH(false, best.leafSize);
+            return best;
+        }
+        
+        const int leafSizes[] = { 1, 2, 4, 8 };
+        const int tileSizes[] = { 8, 16, 32, 64 };
+        std::vector<int> threadCounts;
+        int hardware = ThreadPool::defaultThreadCount();
+        for (int n = 1; n < hardware; n *= 2) threadCounts.push_back(n);
+        threadCounts.push_back(hardware);
+        
+        Image img(width, height);
+        Tile window(width / 4, height / 4, width / 4 + std::max(1, width / 2), height / 4 + std::max(1, height / 2));
+        double bestTime = std::numeric_limits<double>::infinity();
+        for (int leafSize : leafSizes) {
+            scene.buildBVH(false, leafSize);
+            for (int threadCount : threadCounts) {
+                ThreadPool pool(threadCount);
+                for (int tileSize : tileSizes) {
+                    double seconds = std::numeric_limits<double>::infinity();
+                    for (int run = 0; run < 2; ++run) {
+                        seconds = std::min(seconds, timeRender(pool, img, camera, scene, options, window, tileSize));
+                    }
+                    if (verbose) {
+                        std::cout << "  Auto-tune: leaf " << leafSize << ", threads " << threadCount
+                                  << ", tile " << tileSize << ": " << seconds * 1000 << " ms" << std::endl;
+                    }
+                    if (seconds < bestTime) {
+                        bestTime = seconds;
+                        best = RenderSettings(tileSize, threadCount, leafSize);
+                    }
                 }
             }
         }
+        
+        scene.buildBVH(false, best.leafSize);
+        saveCached(cachePath, machine, sceneKey, best);
+        return best;
     }
     
-    // Step c: Render with material colors
-    static void renderMaterials(Image& img, const Camera& camera, const Scene& scene) {
-        for (int y = 0; y < img.height; ++y) {
-            for (int x = 0; x < img.width; ++x) {
-                Ray ray = camera.getRay(x, y, img.width, img.height);
-                
-                double t;
-                int sphereIdx;
-                if (scene.intersect(ray, t, sphereIdx)) {
-                    Vec3 color = scene.spheres[sphereIdx].material.color;
-                    img.setPixel(x, y, color);
-                } else {
-                    img.setPixel(x, y, Vec3(0.5, 0.7, 1.0));
-                }
+private:
+    static double timeRender(ThreadPool& pool, Image& img, const Camera& camera, const Scene& scene,
+                             const RenderOptions& options, const Tile& window, int tileSize) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int y = window.y0; y < window.y1; y += tileSize) {
+            for (int x = window.x0; x < window.x1; x += tileSize) {
+                Tile tile(x, y, std::min(x + tileSize, window.x1), std::min(y + tileSize, window.y1));
+                pool.submit([&img, &camera, &scene, &options, tile] {
+                    Renderer::renderTile(img, camera, scene, options, tile);
+                });
             }
         }
+        pool.wait();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     }
     
-    // Step d: Render with basic diffuse shading (N · L)
-    static void renderDiffuse(Image& img, const Camera& camera, const Scene& scene) {
-        for (int y = 0; y < img.height; ++y) {
-            for (int x = 0; x < img.width; ++x) {
-                Ray ray = camera.getRay(x, y, img.width, img.height);
-                
-                double t;
-                int sphereIdx;
-                if (scene.intersect(ray, t, sphereIdx)) {
-                    Vec3 hitPoint = ray.at(t);
-                    Vec3 normal = scene.spheres[sphereIdx].getNormal(hitPoint);
-                    Vec3 materialColor = scene.spheres[sphereIdx].material.color;
-                    
-                    Vec3 finalColor = scene.ambientLight * materialColor;
-                    
-                    // Add contribution from each light
-                    for (const Light& light : scene.lights) {
-                        Vec3 toLight = (light.position - hitPoint).normalize();
-                        double diffuse = std::max(0.0, normal.dot(toLight));
-                        finalColor = finalColor + materialColor * light.color * (diffuse * light.intensity);
-                    }
-                    
-                    img.setPixel(x, y, finalColor);
-                } else {
-                    img.setPixel(x, y, Vec3(0.5, 0.7, 1.0));
-                }
+    // FNV-1a
+    static void hashBytes(unsigned long long& hash, const void* data, size_t size) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3ULL;
+        }
+    }
+    static void hashValue(unsigned long long& hash, double v) { hashBytes(hash, &v, sizeof(v)); }
+    
+    static void hashBox(unsigned long long& hash, const AABB& box) {
+        hashValue(hash, box.pMin.x());
+        hashValue(hash, box.pMin.y());
+        hashValue(hash, box.pMin.z());
+        hashValue(hash, box.pMax.x());
+        hashValue(hash, box.pMax.y());
+        hashValue(hash, box.pMax.z());
+    }
+    
+    static unsigned long long machineFingerprint() {
+        unsigned long long hash = 0xCBF29CE484222325ULL;
+        unsigned int threads = std::thread::hardware_concurrency();
+        hashBytes(hash, &threads, sizeof(threads));
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 10, "model name") == 0) {
+                hashBytes(hash, line.data(), line.size());
+                break;
             }
         }
+        return hash;
     }
     
-    // Step e: Render with shadows
-    static void renderWithShadows(Image& img, const Camera& camera, const Scene& scene) {
-        for (int y = 0; y < img.height; ++y) {
-            for (int x = 0; x < img.width; ++x) {
-                Ray ray = camera.getRay(x, y, img.width, img.height);
-                
+    // Hashes at most ~4096 evenly spaced spheres (and every quadric and CSG box) so huge scenes stay cheap to fingerprint
+    static unsigned long long sceneFingerprint(const Scene& scene, int width, int height, const RenderOptions& options) {
+        unsigned long long hash = 0xCBF29CE484222325ULL;
+        int header[7] = { width, height, (int)options.output, (int)options.shadows, scene.sphereCount(),
+                          (int)scene.quadrics.size(), (int)scene.csgShapes.size() };
+        hashBytes(hash, header, sizeof(header));
+        int count = scene.sphereCount();
+        int step = std::max(1, count / 4096);
+        for (int i = 0; i < count; i += step) {
+            Sphere sphere = scene.getSphere(i);
+            hashValue(hash, sphere.center.x());
+            hashValue(hash, sphere.center.y());
+            hashValue(hash, sphere.center.z());
+            hashValue(hash, sphere.radius);
+        }
+        for (int i = scene.sphereCount(); i < scene.csgBase(); ++i) hashBox(hash, scene.primitiveBounds(i));
+        for (const CSGShape& shape : scene.csgShapes) hashBox(hash, shape.bounds());
+        for (const Light& light : scene.lights) {
+            hashValue(hash, light.position.x());
+            hashValue(hash, light.position.y());
+            hashValue(hash, light.position.z());
+        }
+        return hash;
+    }
+    
+    // Cache lines: <machine> <scene> <tileSize> <threadCount> <leafSize>
+    static bool loadCached(const std::string& path, unsigned long long machine, unsigned long long sceneKey,
+                           RenderSettings& settings) {
+        std::ifstream file(path.c_str());
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream in(line);
+            unsigned long long m, k;
+            RenderSettings cached;
+            if (in >> std::hex >> m >> k >> std::dec >> cached.tileSize >> cached.threadCount >> cached.leafSize &&
+                m == machine && k == sceneKey) {
+                settings = cached;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static void saveCached(const std::string& path, unsigned long long machine, unsigned long long sceneKey,
+                           const RenderSettings& settings) {
+        std::ofstream file(path.c_str(), std::ios::app);
+        file << std::hex << machine << " " << sceneKey << std::dec << " " << settings.tileSize << " "
+             << settings.threadCount << " " << settings.leafSize << "\n";
+    }
+};
+
+// ====================
+// Cost Predictor Class
+// ====================
+// Render speed of one machine in the predictor's cost model. Profiles are
+// plain "key value" text files so a farm can keep one per node type; the
+// predictor calibrates the local machine when no profile is given.
+struct MachineProfile {
+    std::string name;
+    int threads;
+    double nsPerWorkUnit;       // Single-thread cost of one work unit (see CostPredictor)
+    double parallelEfficiency;  // Speedup per thread relative to perfect scaling
+    
+    MachineProfile() : name("local"), threads(1), nsPerWorkUnit(1.0), parallelEfficiency(0.9) {}
+    
+    // Load a profile; ns_per_work_unit is required, since a default would
+    // silently predict times for the wrong machine
+    bool load(const std::string& path, std::string& error) {
+        std::ifstream file(path.c_str());
+        if (!file) {
+            error = "Could not open profile " + path;
+            return false;
+        }
+        bool hasCost = false;
+        std::string key;
+        while (file >> key) {
+            if (key == "name") file >> name;
+            else if (key == "threads") file >> threads;
+            else if (key == "ns_per_work_unit") hasCost = (bool)(file >> nsPerWorkUnit);
+            else if (key == "parallel_efficiency") file >> parallelEfficiency;
+            else file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            if (!file) {
+                error = "Bad value for " + key + " in profile " + path;
+                return false;
+            }
+        }
+        if (!hasCost || !(nsPerWorkUnit > 0)) {
+            error = "Profile " + path + " needs a positive ns_per_work_unit";
+            return false;
+        }
+        threads = std::max(1, threads);
+        return true;
+    }
+};
+
+// Predicts full-render time and memory from a very low-resolution sampled
+// trace: one ray per probe pixel, at 1/probeDivisor of the resolution in each
+// direction, counting primary rays, shadow rays, BVH nodes visited and sphere
+// tests. These counts are weighted into work units and scaled up to the full
+// pixel and sample count. Calibrating times the real render kernel over the
+// same probe image, so ns per work unit already includes shading.
+class CostPredictor {
+public:
+    // Work-unit weights, relative to one BVH node visit
+    static constexpr double RAY_WEIGHT = 4.0;
+    static constexpr double NODE_WEIGHT = 1.0;
+    static constexpr double SPHERE_TEST_WEIGHT = 1.5;
+    
+    int width, height, samplesPerPixel;
+    int probeWidth, probeHeight;
+    long long primaryRays, shadowRays;
+    TraversalStats stats;
+    double workUnits;   // Probe total
+    MachineProfile machine;
+    
+    static CostPredictor predict(const Scene& scene, const Camera& camera, int width, int height,
+                                 const RenderOptions& options, const MachineProfile* profile = 0,
+                                 int probeDivisor = 8) {
+        CostPredictor prediction;
+        prediction.width = width;
+        prediction.height = height;
+        prediction.samplesPerPixel = options.samplesPerAxis * options.samplesPerAxis;
+        prediction.probeWidth = std::max(1, width / probeDivisor);
+        prediction.probeHeight = std::max(1, height / probeDivisor);
+        
+        bool shadows = options.output == OUTPUT_SHADED && options.shadows;
+        for (int y = 0; y < prediction.probeHeight; ++y) {
+            for (int x = 0; x < prediction.probeWidth; ++x) {
+                Ray ray = camera.getRay(x, y, prediction.probeWidth, prediction.probeHeight);
                 double t;
                 int sphereIdx;
-                if (scene.intersect(ray, t, sphereIdx)) {
-                    Vec3 hitPoint = ray.at(t);
-                    Vec3 normal = scene.spheres[sphereIdx].getNormal(hitPoint);
-                    Vec3 materialColor = scene.spheres[sphereIdx].material.color;
-                    
-                    // Start with ambient light
-                    Vec3 finalColor = scene.ambientLight * materialColor;
-                    
-                    // Add contribution from each light (if not in shadow)
-                    for (const Light& light : scene.lights) {
-                        if (!scene.isInShadow(hitPoint, light.position)) {
-                            Vec3 toLight = (light.position - hitPoint).normalize();
-                            double diffuse = std::max(0.0, normal.dot(toLight));
-                            finalColor = finalColor + materialColor * light.color * (diffuse * light.intensity);
-                        }
-                    }
-                    
-                    img.setPixel(x, y, finalColor);
-                } else {
-                    img.setPixel(x, y, Vec3(0.5, 0.7, 1.0));
+                prediction.primaryRays++;
+                if (!scene.intersectCounted(ray, t, sphereIdx, prediction.stats) || !shadows) continue;
+                Vec3 hitPoint = ray.at(t);
+                for (const Light& light : scene.lights) {
+                    double shadowT;
+                    int occluder;
+                    prediction.shadowRays++;
+                    scene.intersectCounted(Ray(hitPoint, light.position - hitPoint), shadowT, occluder, prediction.stats);
                 }
             }
         }
+        prediction.workUnits = RAY_WEIGHT * prediction.stats.rays + NODE_WEIGHT * prediction.stats.nodesVisited +
+                               SPHERE_TEST_WEIGHT * prediction.stats.primitiveTests;
+        
+        if (profile) {
+            prediction.machine = *profile;
+        } else {
+            prediction.machine.threads = ThreadPool::defaultThreadCount();
+            prediction.machine.nsPerWorkUnit = calibrate(scene, camera, options, prediction);
+        }
+        return prediction;
+    }
+    
+    double scale() const {
+        return (double)width * height * samplesPerPixel / ((double)probeWidth * probeHeight);
+    }
+    
+    double cpuSeconds() const { return workUnits * scale() * machine.nsPerWorkUnit * 1e-9; }
+    
+    double wallSeconds() const {
+        return cpuSeconds() / (1.0 + (machine.threads - 1) * machine.parallelEfficiency);
+    }
+    
+    // Framebuffer plus the scene and its BVH as currently built
+    size_t peakMemoryBytes(const Scene& scene) const {
+        return (size_t)width * height * sizeof(Vec3) + scene.spheres.capacity() * sizeof(Sphere) +
+               scene.compactSpheres.memoryBytes() + scene.particles.memoryBytes() + scene.bvh.memoryBytes() +
+               scene.quadrics.capacity() * sizeof(Quadric) +
+               csgMemoryBytes(scene) +
+               scene.sphereIds.capacity() * sizeof(int) + scene.sphereSlots.capacity() * sizeof(int);
+    }
+    
+    static size_t csgMemoryBytes(const Scene& scene) {
+        size_t bytes = scene.csgShapes.capacity() * sizeof(CSGShape);
+        for (const CSGShape& shape : scene.csgShapes) {
+            bytes += shape.leaves.capacity() * sizeof(Quadric) + shape.nodes.capacity() * sizeof(CSGShape::Node);
+        }
+        return bytes;
+    }
+    
+    // Size of the P3 file savePPM writes: up to 12 bytes per pixel plus the header
+    size_t outputBytes() const { return (size_t)width * height * 12 + 32; }
+    
+    void printJSON(std::ostream& out, const Scene& scene) const {
+        double pixels = (double)probeWidth * probeHeight;
+        out << "{" << std::endl;
+        out << "  \"width\": " << width << "," << std::endl;
+        out << "  \"height\": " << height << "," << std::endl;
+        out << "  \"samples_per_pixel\": " << samplesPerPixel << "," << std::endl;
+        out << "  \"spheres\": " << scene.sphereCount() << "," << std::endl;
+        out << "  \"quadrics\": " << scene.quadrics.size() << "," << std::endl;
+        out << "  \"csg_shapes\": " << scene.csgShapes.size() << "," << std::endl;
+        out << "  \"lights\": " << scene.lights.size() << "," << std::endl;
+        out << "  \"probe\": {" << std::endl;
+        out << "    \"width\": " << probeWidth << "," << std::endl;
+        out << "    \"height\": " << probeHeight << "," << std::endl;
+        out << "    \"primary_rays\": " << primaryRays << "," << std::endl;
+        out << "    \"shadow_rays\": " << shadowRays << "," << std::endl;
+        out << "    \"nodes_visited\": " << stats.nodesVisited << "," << std::endl;
+        out << "    \"sphere_tests\": " << stats.primitiveTests << "," << std::endl;
+        out << "    \"work_units\": " << workUnits << std::endl;
+        out << "  }," << std::endl;
+        out << "  \"per_pixel\": {" << std::endl;
+        out << "    \"rays\": " << stats.rays / pixels << "," << std::endl;
+        out << "    \"nodes_visited\": " << stats.nodesVisited / pixels << "," << std::endl;
+        out << "    \"sphere_tests\": " << stats.primitiveTests / pixels << std::endl;
+        out << "  }," << std::endl;
+        out << "  \"machine\": {" << std::endl;
+        out << "    \"name\": " << jsonString(machine.name) << "," << std::endl;
+        out << "    \"threads\": " << machine.threads << "," << std::endl;
+        out << "    \"ns_per_work_unit\": " << machine.nsPerWorkUnit << "," << std::endl;
+        out << "    \"parallel_efficiency\": " << machine.parallelEfficiency << std::endl;
+        out << "  }," << std::endl;
+        out << "  \"predicted\": {" << std::endl;
+        out << "    \"cpu_seconds\": " << cpuSeconds() << "," << std::endl;
+        out << "    \"wall_seconds\": " << wallSeconds() << "," << std::endl;
+        out << "    \"peak_memory_bytes\": " << peakMemoryBytes(scene) << "," << std::endl;
+        out << "    \"output_bytes\": " << outputBytes() << std::endl;
+        out << "  }" << std::endl;
+        out << "}" << std::endl;
+    }
+    
+private:
+    // Quoted JSON string with quotes, backslashes and control characters escaped
+    static std::string jsonString(const std::string& text) {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += c;
+            } else if ((unsigned char)c < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)c);
+                quoted += escape;
+            } else {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+    
+    CostPredictor()
+        : width(0), height(0), samplesPerPixel(1), probeWidth(0), probeHeight(0),
+          primaryRays(0), shadowRays(0), workUnits(0) {}
+    
+    // Best of three single-threaded renders of the probe image
+    static double calibrate(const Scene& scene, const Camera& camera, const RenderOptions& options,
+                            const CostPredictor& prediction) {
+        Image probe(prediction.probeWidth, prediction.probeHeight);
+        RenderOptions probeOptions = options;
+        probeOptions.samplesPerAxis = 1;
+        double seconds = std::numeric_limits<double>::infinity();
+        for (int run = 0; run < 3; ++run) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            Renderer::render(probe, camera, scene, probeOptions);
+            seconds = std::min(seconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return prediction.workUnits > 0 ? seconds * 1e9 / prediction.workUnits : 0.0;
+    }
+};
+
+// ================
+// Scene File Class
+// ================
+// Text scene description with incremental reload. One item per line, '#'
+// starts a comment; a trailing program name on a primitive selects a program:
+//
+//     image 800 600
+//     camera 0 1 5   0 0 0   0 1 0   60      # position, look-at, up, fov
+//     ambient 0.1 0.1 0.1
+//     light 5 5 5   1 1 1   0.8              # position, color, intensity
+//     program stripes r = 0.5 + 0.5 * sin(x * 10); g = r * cg
+//     sphere 0 0 0 1   1 0.3 0.3   stripes   # center, radius, color
+//     ellipsoid 0 1 0   1 0.3 0.3   1 0.3 1  # center, radii, color
+//     cylinder 0 0 0   0 1 0   0.2   0.8 0.8 0.8
+//     capsule  0 0 0   0 1 0   0.2   0.8 0.8 0.8
+//     cone     0 0 0   0 1 0   0.5 0   1 1 0.3
+//
+// update() compares two parsed descriptions item by item, in file order, and
+// changes only what differs: lights, ambient and programs are replaced, edited
+// materials are written in place, moved primitives refit the BVH, and only a
+// changed primitive count rebuilds it.
+class SceneFile {
+public:
+    struct Description {
+        int width, height;
+        Vec3 cameraPosition, cameraLookAt, cameraUp;
+        double fov;
+        Vec3 ambient;
+        std::vector<Light> lights;
+        std::vector<std::string> programSources;
+        std::vector<MaterialProgram> programs;
+        std::vector<Sphere> spheres;
+        std::vector<Quadric> quadrics;
+        
+        Description()
+            : width(800), height(600), cameraPosition(0, 0, 5), cameraLookAt(0, 0, 0), cameraUp(0, 1, 0), fov(60),
+              ambient(0.1, 0.1, 0.1) {}
+        
+        Camera camera() const { return Camera(cameraPosition, cameraLookAt, cameraUp, fov); }
+    };
+    
+    // What update() touched
+    struct Changes {
+        bool camera, image, ambient, lights, programs;
+        int materials; // Primitives with an edited material
+        int moved;     // Primitives with edited geometry
+        bool refit;    // BVH boxes updated in place
+        bool rebuilt;  // BVH rebuilt from scratch
+        
+        Changes()
+            : camera(false), image(false), ambient(false), lights(false), programs(false), materials(0), moved(0),
+              refit(false), rebuilt(false) {}
+        
+        bool any() const { return camera || image || ambient || lights || programs || materials > 0 || moved > 0 || rebuilt; }
+        
+        void print(std::ostream& out) const {
+            if (!any()) {
+                out << "no changes";
+                return;
+            }
+            const char* separator = "";
+            if (camera) { out << separator << "camera"; separator = ", "; }
+            if (image) { out << separator << "image size"; separator = ", "; }
+            if (ambient) { out << separator << "ambient"; separator = ", "; }
+            if (lights) { out << separator << "lights"; separator = ", "; }
+            if (programs) { out << separator << "programs"; separator = ", "; }
+            if (materials > 0) { out << separator << materials << " materials"; separator = ", "; }
+            if (moved > 0) { out << separator << moved << " moved"; separator = ", "; }
+            if (refit) { out << separator << "BVH refit"; separator = ", "; }
+            if (rebuilt) out << separator << "BVH rebuilt";
+        }
+    };
+    
+    // On failure returns false and describes the first error
+    static bool parse(const std::string& text, Description& description, std::string& error) {
+        description = Description();
+        std::map<std::string, int> programNames;
+        std::istringstream lines(text);
+        std::string line;
+        for (int lineNumber = 1; std::getline(lines, line); ++lineNumber) {
+            size_t comment = line.find('#');
+            if (comment != std::string::npos) line.erase(comment);
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword)) continue;
+            
+            std::string problem;
+            if (!parseItem(keyword, in, description, programNames, problem)) {
+                error = "line " + std::to_string(lineNumber) + ": " + problem;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    static bool load(const std::string& path, Description& description, std::string& error) {
+        std::ifstream file(path.c_str());
+        if (!file) {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+        return parse(text.str(), description, error);
+    }
+    
+    // Replace the scene's contents with the description
+    static void build(const Description& description, Scene& scene, bool lazy = false, int leafSize = 4) {
+        scene = Scene();
+        scene.ambientLight = description.ambient;
+        scene.lights = description.lights;
+        scene.materialPrograms = description.programs;
+        for (const Sphere& sphere : description.spheres) scene.addSphere(sphere);
+        scene.quadrics = description.quadrics;
+        scene.buildBVH(lazy, leafSize);
+    }
+    
+    // Bring a scene built from `current` in line with `next`, touching only what changed
+    static Changes update(const Description& current, const Description& next, Scene& scene) {
+        Changes changes;
+        changes.camera = !same(current.cameraPosition, next.cameraPosition) ||
+                         !same(current.cameraLookAt, next.cameraLookAt) || !same(current.cameraUp, next.cameraUp) ||
+                         current.fov != next.fov;
+        changes.image = current.width != next.width || current.height != next.height;
+        if (!same(current.ambient, next.ambient)) {
+            scene.ambientLight = next.ambient;
+            changes.ambient = true;
+        }
+        if (!sameLights(current.lights, next.lights)) {
+            scene.lights = next.lights;
+            changes.lights = true;
+        }
+        if (current.programSources != next.programSources) {
+            scene.materialPrograms = next.programs;
+            changes.programs = true;
+        }
+        
+        if (current.spheres.size() != next.spheres.size() || current.quadrics.size() != next.quadrics.size()) {
+            scene.spheres.clear();
+            scene.sphereIds.clear();
+            scene.sphereSlots.clear();
+            for (const Sphere& sphere : next.spheres) scene.addSphere(sphere);
+            scene.quadrics = next.quadrics;
+            scene.buildBVH(scene.bvh.isLazy(), scene.bvh.maxLeafSize);
+            changes.rebuilt = true;
+            return changes;
+        }
+        
+        for (size_t i = 0; i < next.spheres.size(); ++i) {
+            const Sphere& a = current.spheres[i];
+            const Sphere& b = next.spheres[i];
+            if (!same(a.center, b.center) || a.radius != b.radius) changes.moved++;
+            else if (!same(a.material, b.material)) changes.materials++;
+            else continue;
+            scene.spheres[scene.sphereIndex((int)i)] = b;
+        }
+        for (size_t i = 0; i < next.quadrics.size(); ++i) {
+            const Quadric& a = current.quadrics[i];
+            const Quadric& b = next.quadrics[i];
+            if (!sameShape(a, b)) changes.moved++;
+            else if (!same(a.material, b.material)) changes.materials++;
+            else continue;
+            scene.quadrics[i] = b;
+        }
+        
+        // Refit while the old tree still suits the scene; past a quarter of the
+        // primitives moving, the looser boxes cost more than a rebuild
+        if (changes.moved * 4 > (int)(next.spheres.size() + next.quadrics.size())) {
+            scene.buildBVH(scene.bvh.isLazy(), scene.bvh.maxLeafSize);
+            changes.rebuilt = true;
+        } else if (changes.moved > 0) {
+            scene.refitBVH();
+            changes.refit = true;
+        }
+        return changes;
+    }
+    
+private:
+    static bool parseItem(const std::string& keyword, std::istringstream& in, Description& description,
+                          std::map<std::string, int>& programNames, std::string& problem) {
+        if (keyword == "program") {
+            std::string name, source;
+            if (!(in >> name)) return fail(problem, "program needs a name");
+            std::getline(in, source);
+            MaterialProgram program;
+            std::string compileError;
+            if (!program.compile(source, compileError)) return fail(problem, "program " + name + ": " + compileError);
+            programNames[name] = (int)description.programs.size();
+            description.programSources.push_back(source);
+            description.programs.push_back(program);
+            return true;
+        }
+        
+        Vec3 a, b;
+        double x, y;
+        if (keyword == "image") {
+            if (!(in >> description.width >> description.height) || description.width <= 0 || description.height <= 0) {
+                return fail(problem, "image needs a positive width and height");
+            }
+        } else if (keyword == "camera") {
+            if (!(readVec3(in, description.cameraPosition) && readVec3(in, description.cameraLookAt) &&
+                  readVec3(in, description.cameraUp) && in >> description.fov)) {
+                return fail(problem, "camera needs position, look-at, up and fov");
+            }
+        } else if (keyword == "ambient") {
+            if (!readVec3(in, description.ambient)) return fail(problem, "ambient needs a color");
+        } else if (keyword == "light") {
+            double intensity = 1.0;
+            if (!readVec3(in, a)) return fail(problem, "light needs a position");
+            if (!readVec3(in, b)) b = Vec3(1, 1, 1);
+            else if (!(in >> intensity)) intensity = 1.0;
+            description.lights.push_back(Light(a, b, intensity));
+        } else if (keyword == "sphere") {
+            Material material;
+            if (!(readVec3(in, a) && in >> x)) return fail(problem, "sphere needs a center and radius");
+            if (!readMaterial(in, programNames, material, problem)) return false;
+            description.spheres.push_back(Sphere(a, x, material));
+        } else if (keyword == "ellipsoid") {
+            Material material;
+            if (!(readVec3(in, a) && readVec3(in, b))) return fail(problem, "ellipsoid needs a center and radii");
+            if (!readMaterial(in, programNames, material, problem)) return false;
+            description.quadrics.push_back(Quadric::ellipsoid(a, b, material));
+        } else if (keyword == "cylinder" || keyword == "capsule" || keyword == "cone") {
+            Material material;
+            if (!(readVec3(in, a) && readVec3(in, b) && in >> x)) {
+                return fail(problem, keyword + " needs two end points and a radius");
+            }
+            y = x;
+            if (keyword == "cone" && !(in >> y)) return fail(problem, "cone needs two radii");
+            if (!readMaterial(in, programNames, material, problem)) return false;
+            if (keyword == "cylinder") description.quadrics.push_back(Quadric::cylinder(a, b, x, material));
+            else if (keyword == "capsule") description.quadrics.push_back(Quadric::capsule(a, b, x, material));
+            else description.quadrics.push_back(Quadric::cone(a, b, x, y, material));
+        } else {
+            return fail(problem, "unknown item '" + keyword + "'");
+        }
+        return true;
+    }
+    
+    static bool fail(std::string& problem, const std::string& what) {
+        problem = what;
+        return false;
+    }
+    
+    static bool readVec3(std::istringstream& in, Vec3& v) {
+        double x, y, z;
+        if (!(in >> x >> y >> z)) return false;
+        v = Vec3(x, y, z);
+        return true;
+    }
+    
+    // Color, then an optional program name
+    static bool readMaterial(std::istringstream& in, const std::map<std::string, int>& programNames,
+                             Material& material, std::string& problem) {
+        if (!readVec3(in, material.color)) return fail(problem, "expected a color");
+        std::string name;
+        if (in >> name) {
+            std::map<std::string, int>::const_iterator it = programNames.find(name);
+            if (it == programNames.end()) return fail(problem, "unknown program '" + name + "'");
+            material.program = it->second;
+        }
+        return true;
+    }
+    
+    static bool same(const Vec3& a, const Vec3& b) { return a.x() == b.x() && a.y() == b.y() && a.z() == b.z(); }
+    static bool same(const Material& a, const Material& b) { return same(a.color, b.color) && a.program == b.program; }
+    
+    static bool sameLights(const std::vector<Light>& a, const std::vector<Light>& b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (!same(a[i].position, b[i].position) || !same(a[i].color, b[i].color) || a[i].intensity != b[i].intensity) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    static bool sameShape(const Quadric& a, const Quadric& b) {
+        if (a.type != b.type) return false;
+        if (a.type == Quadric::ELLIPSOID) {
+            return same(a.center, b.center) && same(a.axes[0], b.axes[0]) && same(a.axes[1], b.axes[1]) &&
+                   same(a.axes[2], b.axes[2]);
+        }
+        return same(a.p0, b.p0) && same(a.p1, b.p1) && a.radius0 == b.radius0 && a.radius1 == b.radius1;
+    }
+};
+
+// ==================
+// File Watcher Class
+// ==================
+// Blocks until a file changes. On Linux it uses inotify on the file's
+// directory, so editors that save by renaming a new file over the old one are
+// caught too. Elsewhere, or without inotify, it polls the modification time
+// (one-second resolution) and size.
+class FileWatcher {
+public:
+    explicit FileWatcher(const std::string& path) : path(path), inotifyFd(-1) {
+        lastStamp = stamp();
+#ifdef __linux__
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+        fileName = slash == std::string::npos ? path : path.substr(slash + 1);
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd >= 0 && inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            close(inotifyFd);
+            inotifyFd = -1;
+        }
+#endif
+    }
+    
+    ~FileWatcher() {
+#ifdef __linux__
+        if (inotifyFd >= 0) close(inotifyFd);
+#endif
+    }
+    
+    bool usesInotify() const { return inotifyFd >= 0; }
+    
+    // Return once the file has changed and then stayed quiet for settleSeconds,
+    // since editors often save in several writes
+    void wait(double settleSeconds = 0.05) {
+        while (!changedWithin(-1)) {}
+        while (changedWithin(settleSeconds)) {}
+    }
+    
+private:
+    std::string path;
+    std::string fileName;
+    int inotifyFd;
+    long long lastStamp;
+    
+    // True when a change shows up within timeout seconds (negative: no limit)
+    bool changedWithin(double timeout) {
+#ifdef __linux__
+        if (inotifyFd >= 0) {
+            pollfd request = { inotifyFd, POLLIN, 0 };
+            if (poll(&request, 1, timeout < 0 ? -1 : (int)(timeout * 1000)) <= 0) return false;
+            return drainEvents();
+        }
+#endif
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (;;) {
+            long long current = stamp();
+            if (current != lastStamp) {
+                lastStamp = current;
+                return true;
+            }
+            double remaining = timeout - std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (timeout >= 0 && remaining <= 0) return false;
+            double pause = timeout < 0 ? 0.1 : std::min(0.1, remaining);
+            std::this_thread::sleep_for(std::chrono::duration<double>(pause));
+        }
+    }
+    
+    long long stamp() const {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) return -1;
+        return (long long)info.st_mtime * 1000003LL + (long long)info.st_size;
+    }
+    
+#ifdef __linux__
+    // Read every queued event; true if any names the watched file
+    bool drainEvents() {
+        alignas(inotify_event) char buffer[4096];
+        bool match = false;
+        ssize_t length;
+        while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length;) {
+                const inotify_event* event = (const inotify_event*)p;
+                if (event->len > 0 && fileName == event->name) match = true;
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+        return match;
     }
+#endif
 };
 
 // ============
 // Main Program
 // ============
-int main() {
-    // Image settings
-    const int width = 800;
-    const int height = 600;
+// Whole-argument number parsing for the command line: leading spaces, trailing
+// text, an empty argument, values out of range and non-finite values are rejected
+static bool parseIntArg(const char* text, int minimum, int& value,
+                        int maximum = std::numeric_limits<int>::max()) {
+    char* end;
+    errno = 0;
+    long parsed = std::strtol(text, &end, 10);
+    if (end == text || std::isspace((unsigned char)*text) || *end != '\0' || errno == ERANGE ||
+        parsed < minimum || parsed > maximum) return false;
+    value = (int)parsed;
+    return true;
+}
+
+// WxH with both sides from 1 to MAX_IMAGE_SIDE; width and height are left
+// unchanged on failure
+static const int MAX_IMAGE_SIDE = 1 << 20;
+static bool parseSizeArg(const char* text, int& width, int& height) {
+    const char* separator = std::strchr(text, 'x');
+    if (!separator) return false;
+    std::string w(text, separator);
+    int parsedWidth, parsedHeight;
+    if (!parseIntArg(w.c_str(), 1, parsedWidth, MAX_IMAGE_SIDE) ||
+        !parseIntArg(separator + 1, 1, parsedHeight, MAX_IMAGE_SIDE)) return false;
+    width = parsedWidth;
+    height = parsedHeight;
+    return true;
+}
+
+static bool parseDoubleArg(const char* text, double minimum, double maximum, double& value) {
+    char* end;
+    errno = 0;
+    double parsed = std::strtod(text, &end);
+    if (end == text || std::isspace((unsigned char)*text) || *end != '\0' || errno == ERANGE ||
+        !std::isfinite(parsed) || parsed < minimum || parsed > maximum) return false;
+    value = parsed;
+    return true;
+}
+
+static void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [command] [options]" << std::endl;
+    std::cout << "  (no command)      Render the four pipeline stages to output_*.ppm" << std::endl;
+    std::cout << "  --bvh-report      Build the BVH and print its quality report" << std::endl;
+    std::cout << "  --auto-tune       Pick tile size, threads and leaf size for this machine and" << std::endl;
+    std::cout << "                    scene (cached in raytracer_tune.cache), then render in parallel" << std::endl;
+    std::cout << "  --budget SECONDS  Render the best final image that fits the time budget" << std::endl;
+    std::cout << "                    to output_budget.ppm" << std::endl;
+    std::cout << "  --predict         Estimate full-render time and memory from a sampled trace," << std::endl;
+    std::cout << "                    printed as JSON" << std::endl;
+    std::cout << "  --variable-rate   Render with per-tile sampling and shading rates from an" << std::endl;
+    std::cout << "                    automatic importance map to output_variable_rate.ppm" << std::endl;
+    std::cout << "  --watch FILE      Render a scene file to output_watch.ppm and re-render whenever" << std::endl;
+    std::cout << "                    it is saved, applying only what changed" << std::endl;
+    std::cout << "  --mapped FILE     Render the final stage straight into a memory-mapped FILE" << std::endl;
+    std::cout << "                    (.pfm for float pixels, otherwise binary PPM)" << std::endl;
+    std::cout << "  --out-of-core FILE" << std::endl;
+    std::cout << "                    Render the final stage to a binary PPM a band of rows at a" << std::endl;
+    std::cout << "                    time, for images too large to hold in memory" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --size WxH        Image size, each side 1 to 1048576 (default 800x600)" << std::endl;
+    std::cout << "  --filter-radius N Tent filter radius in pixels for --out-of-core, at most the" << std::endl;
+    std::cout << "                    image width or height (default 0)" << std::endl;
+    std::cout << "  --leaf-size N     Maximum BVH leaf size (default 4)" << std::endl;
+    std::cout << "  --lazy            Build the BVH lazily" << std::endl;
+    std::cout << "  --profile FILE    Machine profile for --predict (default: calibrate this machine)" << std::endl;
+}
+
+// --watch: render, wait for the scene file to change, apply the edit, repeat
+static int watchScene(const std::string& path, bool lazyBVH, int leafSize) {
+    typedef std::chrono::steady_clock Clock;
+    SceneFile::Description current;
+    std::string error;
+    if (!SceneFile::load(path, current, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+    Scene scene;
+    SceneFile::build(current, scene, lazyBVH, leafSize);
+    ThreadPool pool;
+    FileWatcher watcher(path);
+    std::cout << "Watching " << path << (watcher.usesInotify() ? " (inotify)" : " (polling)")
+              << ", Ctrl-C to stop" << std::endl;
     
-    // Step a: Create image
-    Image img(width, height);
+    RenderOptions options(OUTPUT_SHADED, true);
+    for (;;) {
+        Clock::time_point start = Clock::now();
+        Image img(current.width, current.height);
+        Camera camera = current.camera();
+        std::vector<Tile> tiles = Tile::split(img.width, img.height, 32);
+        for (const Tile& tile : tiles) {
+            pool.submit([&img, &camera, &scene, &options, tile] { Renderer::renderTile(img, camera, scene, options, tile); });
+        }
+        pool.wait();
+        img.savePPM("output_watch.ppm");
+        std::cout << "Rendered output_watch.ppm in "
+                  << std::chrono::duration<double, std::milli>(Clock::now() - start).count() << " ms" << std::endl;
+        
+        for (;;) {
+            watcher.wait();
+            SceneFile::Description next;
+            if (!SceneFile::load(path, next, error)) {
+                std::cerr << "Error: " << error << " (keeping the previous scene)" << std::endl;
+                continue;
+            }
+            Clock::time_point applyStart = Clock::now();
+            SceneFile::Changes changes = SceneFile::update(current, next, scene);
+            current = next;
+            std::cout << "Reloaded: ";
+            changes.print(std::cout);
+            std::cout << " (" << std::chrono::duration<double, std::milli>(Clock::now() - applyStart).count()
+                      << " ms)" << std::endl;
+            if (changes.any()) break;
+        }
+    }
+}
+
+// --mapped: render the final stage tile by tile into a memory-mapped output file
+static int renderMapped(const std::string& path, const Camera& camera, Scene& scene, int width, int height,
+                        bool lazyBVH, int leafSize) {
+    typedef std::chrono::steady_clock Clock;
+    bool isFloat = path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+    MappedImage img;
+    std::string error;
+    if (!img.open(path, width, height, isFloat ? MappedImage::MAPPED_FLOAT : MappedImage::MAPPED_P6, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+    Clock::time_point start = Clock::now();
+    scene.buildBVH(lazyBVH, leafSize);
+    ThreadPool pool;
+    RenderOptions options(OUTPUT_SHADED, true);
+    std::vector<Tile> tiles = Tile::split(width, height, 32);
+    for (const Tile& tile : tiles) {
+        pool.submit([&img, &camera, &scene, &options, tile] { Renderer::renderTile(img, camera, scene, options, tile); });
+    }
+    pool.wait();
+    if (!img.close(error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+    std::cout << "Rendered " << width << "x" << height << " to " << path << " in "
+              << std::chrono::duration<double>(Clock::now() - start).count() << " s" << std::endl;
+    return 0;
+}
+
+// --out-of-core: render the final stage band by band, streaming rows to disk
+static int renderOutOfCore(const std::string& path, const Camera& camera, Scene& scene, int width, int height,
+                           int filterRadius, bool lazyBVH, int leafSize) {
+    typedef std::chrono::steady_clock Clock;
+    const int bandRows = 32;
+    Clock::time_point start = Clock::now();
+    scene.buildBVH(lazyBVH, leafSize);
+    std::string error;
+    if (!OutOfCoreRenderer::render(path, width, height, camera, scene, RenderOptions(OUTPUT_SHADED, true), error,
+                                   bandRows, filterRadius)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+    std::cout << "Rendered " << width << "x" << height << " to " << path << " in "
+              << std::chrono::duration<double>(Clock::now() - start).count() << " s, holding "
+              << OutOfCoreRenderer::workingSetBytes(width, bandRows, filterRadius) / (1024.0 * 1024.0)
+              << " MB of pixels" << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    bool bvhReport = false;
+    bool autoTune = false;
+    bool lazyBVH = false;
+    int leafSize = 4;
+    double budget = -1;
+    bool predict = false;
+    bool variableRate = false;
+    std::string profilePath;
+    std::string watchPath;
+    std::string mappedPath;
+    std::string outOfCorePath;
+    int filterRadius = 0;
+    int width = 800;
+    int height = 600;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--bvh-report") {
+            bvhReport = true;
+        } else if (arg == "--auto-tune") {
+            autoTune = true;
+        } else if (arg == "--budget" && i + 1 < argc && parseDoubleArg(argv[i + 1], 0, BudgetRenderer::MAX_BUDGET_SECONDS, budget)) {
+            ++i;
+        } else if (arg == "--variable-rate") {
+            variableRate = true;
+        } else if (arg == "--watch" && i + 1 < argc) {
+            watchPath = argv[++i];
+        } else if (arg == "--mapped" && i + 1 < argc) {
+            mappedPath = argv[++i];
+        } else if (arg == "--out-of-core" && i + 1 < argc) {
+            outOfCorePath = argv[++i];
+        } else if (arg == "--filter-radius" && i + 1 < argc && parseIntArg(argv[i + 1], 0, filterRadius)) {
+            ++i;
+        } else if (arg == "--size" && i + 1 < argc && parseSizeArg(argv[i + 1], width, height)) {
+            ++i;
+        } else if (arg == "--predict") {
+            predict = true;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (arg == "--lazy") {
+            lazyBVH = true;
+        } else if (arg == "--leaf-size" && i + 1 < argc && parseIntArg(argv[i + 1], 1, leafSize)) {
+            ++i;
+        } else {
+            printUsage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    // Checked once --size is known, whichever order the flags came in
+    if (filterRadius > std::max(width, height)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    
+    if (!watchPath.empty()) {
+        return watchScene(watchPath, lazyBVH, leafSize);
+    }
     
     // Setup camera
     Camera camera(Vec3(0, 0, 5), Vec3(0, 0, 0), Vec3(0, 1, 0), 60);
@@ -381,6 +5750,77 @@ int main() {
     scene.addLight(Light(Vec3(5, 5, 5), Vec3(1, 1, 1), 0.8));
     scene.addLight(Light(Vec3(-5, 3, 3), Vec3(1, 0.9, 0.8), 0.4));
     
+    if (!mappedPath.empty()) {
+        return renderMapped(mappedPath, camera, scene, width, height, lazyBVH, leafSize);
+    }
+    
+    if (!outOfCorePath.empty()) {
+        return renderOutOfCore(outOfCorePath, camera, scene, width, height, filterRadius, lazyBVH, leafSize);
+    }
+    
+    // Step a: Create image
+    Image img(width, height);
+    
+    if (bvhReport) {
+        scene.buildBVH(lazyBVH, leafSize);
+        BVHReport::analyze(scene, camera, width, height).print(std::cout);
+        return 0;
+    }
+    
+    if (predict) {
+        MachineProfile profile;
+        std::string error;
+        if (!profilePath.empty() && !profile.load(profilePath, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+        scene.buildBVH(lazyBVH, leafSize);
+        CostPredictor prediction = CostPredictor::predict(scene, camera, width, height, RenderOptions(),
+                                                          profilePath.empty() ? 0 : &profile);
+        prediction.printJSON(std::cout, scene);
+        return 0;
+    }
+    
+    if (variableRate) {
+        scene.buildBVH(lazyBVH, leafSize);
+        ImportanceMap importance = ImportanceMap::fromAOVs(scene, camera, width, height);
+        long long rays = VariableRateRenderer::render(img, camera, scene, RenderOptions(), importance);
+        img.savePPM("output_variable_rate.ppm");
+        std::cout << "Traced " << rays << " primary rays (" << 100.0 * rays / ((double)width * height)
+                  << "% of one per pixel)" << std::endl;
+        std::cout << "Saved output_variable_rate.ppm" << std::endl;
+        return 0;
+    }
+    
+    if (budget >= 0) {
+        scene.buildBVH(lazyBVH, leafSize);
+        BudgetResult result = BudgetRenderer::render(img, camera, scene, RenderOptions(), budget);
+        img.savePPM("output_budget.ppm");
+        std::cout << "Rendered at 1/" << result.quality.resolutionDivisor << " resolution, "
+                  << result.quality.samplesPerAxis * result.quality.samplesPerAxis << " spp"
+                  << (result.completed ? "" : " (deadline reached, remaining tiles from preview)")
+                  << " in " << result.seconds << " s" << std::endl;
+        std::cout << "Saved output_budget.ppm" << std::endl;
+        return 0;
+    }
+    
+    if (autoTune) {
+        RenderSettings settings = AutoTuner::tune(scene, camera, width, height, RenderOptions(),
+                                                  "raytracer_tune.cache", true);
+        std::cout << "Tuned settings: tile " << settings.tileSize << ", threads " << settings.threadCount
+                  << ", leaf size " << settings.leafSize << std::endl;
+        
+        std::cout << "Rendering all stages as one batch..." << std::endl;
+        std::vector<RenderView> views;
+        views.push_back(RenderView::perspective(camera, width, height, RenderOptions(OUTPUT_DISTANCE, false), "output_distance.ppm"));
+        views.push_back(RenderView::perspective(camera, width, height, RenderOptions(OUTPUT_MATERIAL, false), "output_materials.ppm"));
+        views.push_back(RenderView::perspective(camera, width, height, RenderOptions(OUTPUT_SHADED, false), "output_diffuse.ppm"));
+        views.push_back(RenderView::perspective(camera, width, height, RenderOptions(OUTPUT_SHADED, true), "output_final.ppm"));
+        BatchRenderer::renderAndSave(scene, views, settings.threadCount, settings.tileSize);
+        std::cout << "Done!" << std::endl;
+        return 0;
+    }
+    
     std::cout << "Rendering images..." << std::endl;
     
     // Step b: Render distance